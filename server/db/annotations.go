@@ -0,0 +1,215 @@
+package db
+
+import (
+	"bytes"
+	"fmt"
+	"sort"
+	"unsafe"
+)
+
+// #include "../../src/cindex.h"
+import "C"
+
+type annotationHeader C.AnnotationHeader
+type annotation C.Annotation
+type annotationTarget C.AnnotationTarget
+
+const (
+	kAnnotationSpan    = uint8(C.kAnnotationSpan)
+	kAnnotationKeyword = uint8(C.kAnnotationKeyword)
+	kAnnotationUse     = uint8(C.kAnnotationUse)
+	kAnnotationDefine  = uint8(C.kAnnotationDefine)
+	kAnnotationDeclare = uint8(C.kAnnotationDeclare)
+	kAnnotationInclude = uint8(C.kAnnotationInclude)
+)
+
+const kEventOpen = uint64(1) << 31
+const kEventRankMask = kEventOpen - 1
+
+type annotationStream struct {
+	data        []byte
+	sourcesize  int
+	annotations int
+	targets     int
+	classes     []string
+}
+
+func (as *annotationStream) annotation(index int) *annotation {
+	offset := int(unsafe.Sizeof(annotationHeader{})) + index*int(unsafe.Sizeof(annotation{}))
+	return (*annotation)(unsafe.Pointer(&as.data[offset]))
+}
+
+func (as *annotationStream) target(index int) *annotationTarget {
+	offset := int(unsafe.Sizeof(annotationHeader{})) + as.annotations*int(unsafe.Sizeof(annotation{})) + index*int(unsafe.Sizeof(annotationTarget{}))
+	return (*annotationTarget)(unsafe.Pointer(&as.data[offset]))
+}
+
+func parseAnnotations(data []byte) (*annotationStream, error) {
+	hsize := int(unsafe.Sizeof(annotationHeader{}))
+	if len(data) < hsize {
+		return nil, fmt.Errorf("annotations too short - %d bytes", len(data))
+	}
+	header := (*annotationHeader)(unsafe.Pointer(&data[0]))
+
+	as := &annotationStream{data: data, sourcesize: int(header.sourcesize), annotations: int(header.annotations), targets: int(header.targets)}
+	offset := hsize + as.annotations*int(unsafe.Sizeof(annotation{})) + as.targets*int(unsafe.Sizeof(annotationTarget{}))
+	if len(data) < offset {
+		return nil, fmt.Errorf("annotations truncated - %d bytes, %d annotations, %d targets", len(data), as.annotations, as.targets)
+	}
+
+	for len(as.classes) < int(header.classes) {
+		if offset+2 > len(data) {
+			return nil, fmt.Errorf("annotations truncated - class %d", len(as.classes))
+		}
+		size := int(*(*uint16)(unsafe.Pointer(&data[offset])))
+		offset += 2
+		if offset+size > len(data) {
+			return nil, fmt.Errorf("annotations truncated - class %d", len(as.classes))
+		}
+		as.classes = append(as.classes, string(data[offset:offset+size]))
+		offset += size
+	}
+
+	for i := 0; i < as.annotations; i++ {
+		a := as.annotation(i)
+		if int(a.classes) >= len(as.classes) {
+			return nil, fmt.Errorf("annotation %d has invalid class %d", i, a.classes)
+		}
+		if kind := uint8(a.kind); kind != kAnnotationSpan && kind != kAnnotationKeyword && int(a.target) >= as.targets {
+			return nil, fmt.Errorf("annotation %d has invalid target %d", i, a.target)
+		}
+	}
+	return as, nil
+}
+
+func annotationHref(hash uint64) string {
+	hex := fmt.Sprintf("%016x", hash)
+	return "../" + hex[14:] + "/" + hex[:14] + ".html"
+}
+
+func annotationId(target *annotationTarget) string {
+	sl, el := uint64(target.sid.sid), uint64(target.sid.eid)
+	if sl == 0 || sl == el {
+		return fmt.Sprintf("%016x", el)
+	}
+	return fmt.Sprintf("%016x%016x", sl, el)
+}
+
+func isKeyword(text []byte) bool {
+	for _, c := range text {
+		if !(c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z' || c >= '0' && c <= '9' || c == '_') {
+			return false
+		}
+	}
+	return true
+}
+
+func writeEscapedHtml(output *bytes.Buffer, text []byte) {
+	for _, c := range text {
+		switch c {
+		case '&':
+			output.WriteString("&amp;")
+		case '<':
+			output.WriteString("&lt;")
+		case '>':
+			output.WriteString("&gt;")
+		default:
+			output.WriteByte(c)
+		}
+	}
+}
+
+func annotationElement(a *annotation) string {
+	if kind := uint8(a.kind); kind == kAnnotationUse || kind == kAnnotationInclude {
+		return "a"
+	}
+	return "span"
+}
+
+func (as *annotationStream) writeOpen(output *bytes.Buffer, source []byte, a *annotation) {
+	class := as.classes[a.classes]
+	output.WriteString("<" + annotationElement(a) + " class='")
+	switch uint8(a.kind) {
+	case kAnnotationSpan, kAnnotationInclude:
+		output.WriteString(class)
+	case kAnnotationKeyword:
+		output.WriteString(class)
+		start, end := int(a.offset), int(a.offset)+int(a.length)
+		if a.length > 0 && end <= len(source) && isKeyword(source[start:end]) {
+			output.WriteString(" ")
+			output.Write(source[start:end])
+		}
+	case kAnnotationUse:
+		output.WriteString(class + "-uses")
+	case kAnnotationDefine:
+		output.WriteString("def def-" + class)
+	case kAnnotationDeclare:
+		output.WriteString("decl decl-" + class)
+	}
+	output.WriteString("'")
+
+	switch uint8(a.kind) {
+	case kAnnotationUse:
+		target := as.target(int(a.target))
+		output.WriteString(" href='" + annotationHref(uint64(target.filehash)) + "#" + annotationId(target) + "'")
+	case kAnnotationInclude:
+		target := as.target(int(a.target))
+		output.WriteString(" href='" + annotationHref(uint64(target.filehash)) + "'")
+	case kAnnotationDefine, kAnnotationDeclare:
+		output.WriteString(" id='" + annotationId(as.target(int(a.target))) + "'")
+	}
+	output.WriteString(">")
+}
+
+// RenderAnnotations returns the html of a source output with --annotations,
+// from the content of its .jsrc and .jann files. It produces the same html
+// sbexr would have written in the .jhtml file.
+func RenderAnnotations(source, data []byte) ([]byte, error) {
+	as, err := parseAnnotations(data)
+	if err != nil {
+		return nil, err
+	}
+	if as.sourcesize != len(source) {
+		return nil, fmt.Errorf("annotations are for a source of %d bytes, not %d", as.sourcesize, len(source))
+	}
+
+	// Same events as in HtmlRewriter::Generate: offset << 32 | phase << 31 | rank,
+	// with closes before opens, and closes in the reverse order of opens.
+	events := make([]uint64, 0, as.annotations*2)
+	for i := 0; i < as.annotations; i++ {
+		a := as.annotation(i)
+		events = append(events, uint64(a.offset)<<32|kEventOpen|uint64(i))
+		if a.length > 0 {
+			events = append(events, (uint64(a.offset)+uint64(a.length))<<32|(^uint64(i)&kEventRankMask))
+		}
+	}
+	sort.Slice(events, func(i, j int) bool { return events[i] < events[j] })
+
+	var output bytes.Buffer
+	output.Grow(len(source) * 2)
+	pos := 0
+	for _, event := range events {
+		offset := int(event >> 32)
+		if offset > len(source) {
+			offset = len(source)
+		}
+		if offset > pos {
+			writeEscapedHtml(&output, source[pos:offset])
+			pos = offset
+		}
+
+		if event&kEventOpen == 0 {
+			a := as.annotation(int(^event & kEventRankMask))
+			output.WriteString("</" + annotationElement(a) + ">")
+			continue
+		}
+
+		a := as.annotation(int(event & kEventRankMask))
+		as.writeOpen(&output, source, a)
+		if a.length == 0 {
+			output.WriteString("</" + annotationElement(a) + ">")
+		}
+	}
+	writeEscapedHtml(&output, source[pos:])
+	return output.Bytes(), nil
+}
@@ -0,0 +1,87 @@
+package db
+
+import (
+	"encoding/binary"
+	"github.com/stretchr/testify/assert"
+	"io/ioutil"
+	"testing"
+)
+
+// The files in testdata were written by sbexr, from the same source and
+// tags: annotations.html by HtmlRewriter::Generate, as it goes in the
+// .jhtml file, and annotations.jann by HtmlRewriter::Annotate. They cover
+// every kind of annotation, nesting, an empty tag and escaped text.
+func readAnnotationsFixture(t *testing.T) (source, data, html []byte) {
+	var err error
+	source, err = ioutil.ReadFile("testdata/annotations.jsrc")
+	assert.NoError(t, err)
+	data, err = ioutil.ReadFile("testdata/annotations.jann")
+	assert.NoError(t, err)
+	html, err = ioutil.ReadFile("testdata/annotations.html")
+	assert.NoError(t, err)
+	return source, data, html
+}
+
+func TestRenderAnnotations(t *testing.T) {
+	assert := assert.New(t)
+	source, data, html := readAnnotationsFixture(t)
+
+	output, err := RenderAnnotations(source, data)
+	assert.NoError(err)
+	assert.Equal(string(html), string(output))
+}
+
+func TestRenderAnnotationsNoAnnotations(t *testing.T) {
+	assert := assert.New(t)
+
+	data := make([]byte, 16)
+	binary.LittleEndian.PutUint32(data[12:], 9)
+	output, err := RenderAnnotations([]byte("a < b & c"), data)
+	assert.NoError(err)
+	assert.Equal("a &lt; b &amp; c", string(output))
+}
+
+func TestRenderAnnotationsInvalid(t *testing.T) {
+	assert := assert.New(t)
+	source, data, _ := readAnnotationsFixture(t)
+
+	// Truncated anywhere, in the header, annotations, targets or classes.
+	for size := 0; size < len(data); size++ {
+		_, err := RenderAnnotations(source, data[:size])
+		assert.Error(err, "truncated to %d bytes", size)
+	}
+
+	// The source does not match the annotations.
+	_, err := RenderAnnotations(source[:len(source)-1], data)
+	assert.Error(err)
+	_, err = RenderAnnotations(append(source, 'x'), data)
+	assert.Error(err)
+
+	// The header is followed by the annotations, 16 bytes each: offset,
+	// length, kind, flags, class index and target index. The first one is
+	// an include, which has a target.
+	const header = 16
+	const classes = header + 10
+	const target = header + 12
+
+	corrupted := append([]byte(nil), data...)
+	binary.LittleEndian.PutUint16(corrupted[classes:], 6)
+	_, err = RenderAnnotations(source, corrupted)
+	assert.Error(err, "class out of range")
+
+	corrupted = append([]byte(nil), data...)
+	binary.LittleEndian.PutUint32(corrupted[target:], 4)
+	_, err = RenderAnnotations(source, corrupted)
+	assert.Error(err, "target out of range")
+
+	// More classes or targets than the data has.
+	corrupted = append([]byte(nil), data...)
+	binary.LittleEndian.PutUint32(corrupted[8:], 7)
+	_, err = RenderAnnotations(source, corrupted)
+	assert.Error(err, "missing class")
+
+	corrupted = append([]byte(nil), data...)
+	binary.LittleEndian.PutUint32(corrupted[4:], 1000)
+	_, err = RenderAnnotations(source, corrupted)
+	assert.Error(err, "missing targets")
+}
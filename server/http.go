@@ -4,6 +4,7 @@ import (
 	"encoding/json"
 	"github.com/ccontavalli/goutils/config"
 	"github.com/ccontavalli/goutils/misc"
+	"github.com/ccontavalli/sbexr/server/db"
 	"github.com/ccontavalli/sbexr/server/structs"
 	"github.com/ccontavalli/sbexr/server/templates"
 	"io/ioutil"
@@ -12,6 +13,7 @@ import (
 	"os"
 	"path"
 	"path/filepath"
+	"strconv"
 	"strings"
 	"sync"
 )
@@ -73,12 +75,82 @@ func (ss *SourceServer) getTagData(upath string, sources int) structs.JNavData {
 	return structs.JNavData{}
 }
 
+// Compressed variants written by sbexr --precompress, in order of preference.
+var kPrecompressed = []struct{ encoding, extension string }{
+	{"zstd", ".zst"},
+	{"gzip", ".gz"},
+}
+
+// acceptsEncoding returns true if an Accept-Encoding header allows
+// encoding, honoring q values, so "gzip;q=0" refuses gzip, and "*".
+func acceptsEncoding(header, encoding string) bool {
+	wildcard := false
+	for _, element := range strings.Split(header, ",") {
+		params := strings.Split(element, ";")
+		coding := strings.ToLower(strings.TrimSpace(params[0]))
+		if coding != encoding && coding != "*" {
+			continue
+		}
+
+		q := 1.0
+		for _, param := range params[1:] {
+			param = strings.ToLower(strings.TrimSpace(param))
+			if !strings.HasPrefix(param, "q=") {
+				continue
+			}
+			if value, err := strconv.ParseFloat(param[2:], 64); err == nil {
+				q = value
+			}
+		}
+		if coding == encoding {
+			return q > 0
+		}
+		wildcard = q > 0
+	}
+	return wildcard
+}
+
+// serveFile is like http.ServeFile, but sends the precompressed variant of
+// the file, if there is one the client accepts. Variants older than the
+// file are stale, and ignored.
+func serveFile(w http.ResponseWriter, r *http.Request, name string) {
+	original, err := os.Stat(name)
+	if err != nil || original.IsDir() {
+		http.ServeFile(w, r, name)
+		return
+	}
+
+	accept := r.Header.Get("Accept-Encoding")
+	for _, variant := range kPrecompressed {
+		if !acceptsEncoding(accept, variant.encoding) {
+			continue
+		}
+		file, err := os.Open(name + variant.extension)
+		if err != nil {
+			continue
+		}
+		stat, err := file.Stat()
+		if err != nil || stat.IsDir() || stat.ModTime().Before(original.ModTime()) {
+			file.Close()
+			continue
+		}
+		defer file.Close()
+
+		w.Header().Set("Content-Encoding", variant.encoding)
+		w.Header().Add("Vary", "Accept-Encoding")
+		// The content type is guessed from name, not the compressed file.
+		http.ServeContent(w, r, name, stat.ModTime(), file)
+		return
+	}
+	http.ServeFile(w, r, name)
+}
+
 func (ss *SourceServer) ServeHTTP(w http.ResponseWriter, r *http.Request) {
 	upath := misc.CleanPreserveSlash(r.URL.Path)
 
 	sources := strings.Index(upath, kSourceRoot)
 	if sources < 0 {
-		http.ServeFile(w, r, filepath.Join(ss.root, filepath.Clean(upath)))
+		serveFile(w, r, filepath.Join(ss.root, filepath.Clean(upath)))
 		return
 	}
 
@@ -115,6 +187,15 @@ func (ss *SourceServer) ServeHTTP(w http.ResponseWriter, r *http.Request) {
 	}
 
 	cpath := filepath.Join(ss.root, strings.TrimSuffix(upath, extension))
+	// Files output as is, like media or the .raw copy of blobs, share the
+	// name of the .jhtml file, and must not be rendered in its place.
+	if extension != "" && extension != ".html" && extension != ".jhtml" {
+		if stat, err := os.Stat(cpath + extension); err == nil && !stat.IsDir() {
+			serveFile(w, r, cpath+extension)
+			return
+		}
+	}
+
 	// Pseudo code:
 	// 1) try to read jhtml file, and corresponding json.
 	jdir := structs.JDir{JNavData: tagdata}
@@ -130,7 +211,7 @@ func (ss *SourceServer) ServeHTTP(w http.ResponseWriter, r *http.Request) {
 		if extension == "" {
 			extension = ".html"
 		}
-		http.ServeFile(w, r, cpath+extension)
+		serveFile(w, r, cpath+extension)
 		return
 	}
 
@@ -142,10 +223,49 @@ func (ss *SourceServer) ServeHTTP(w http.ResponseWriter, r *http.Request) {
 		return
 	}
 
+	// Sources output with --annotations are rendered here, from the source
+	// and annotations stored next to the .jhtml file.
+	annotated, err := renderAnnotations(cpath)
+	if err == nil {
+		content = annotated
+	} else if !os.IsNotExist(err) {
+		log.Printf("CORRUPTED ANNOTATIONS - %s, %#v", cpath, err)
+		http.Error(w, "CORRUPTED FILE", http.StatusInternalServerError)
+		return
+	}
+
 	filepage := &templates.SourcePage{jdir, content}
 	templates.WritePageTemplate(w, filepage)
 }
 
+// Returns os.ErrNotExist if there are no annotations for cpath, or they are
+// older than its .jhtml file: left behind by a run without --annotations.
+func renderAnnotations(cpath string) ([]byte, error) {
+	html, err := os.Stat(cpath + ".jhtml")
+	if err != nil {
+		return nil, err
+	}
+	for _, extension := range []string{".jann", ".jsrc"} {
+		stat, err := os.Stat(cpath + extension)
+		if err != nil {
+			return nil, err
+		}
+		if stat.ModTime().Before(html.ModTime()) {
+			return nil, os.ErrNotExist
+		}
+	}
+
+	annotations, err := ioutil.ReadFile(cpath + ".jann")
+	if err != nil {
+		return nil, err
+	}
+	source, err := ioutil.ReadFile(cpath + ".jsrc")
+	if err != nil {
+		return nil, err
+	}
+	return db.RenderAnnotations(source, annotations)
+}
+
 func (ss *SourceServer) Update() {
 	list, err := ioutil.ReadDir(ss.root)
 	if err != nil {
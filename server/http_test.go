@@ -6,9 +6,12 @@ import (
 	"io/ioutil"
 	"net/http"
 	"net/http/httptest"
+	"os"
 	"path"
+	"path/filepath"
 	"strings"
 	"testing"
+	"time"
 )
 
 func IsValidPage(assert *assert.Assertions, body string) {
@@ -82,3 +85,78 @@ func TestHandlers(t *testing.T) {
 		assert.Regexp("<title>[^<]*test[^<]*</title>", string(body))
 	}
 }
+
+func TestServeRawBlob(t *testing.T) {
+	assert := assert.New(t)
+	dir, err := ioutil.TempDir("", "sbexr-sources")
+	assert.NoError(err)
+	defer os.RemoveAll(dir)
+
+	// With --output-blobs, the .raw copy is next to the .jhtml of the blob.
+	blob := filepath.Join(dir, "output", "sources", "ab", "cdef")
+	assert.NoError(os.MkdirAll(filepath.Dir(blob), 0755))
+	assert.NoError(ioutil.WriteFile(blob+".jhtml", []byte("{}\n"), 0644))
+	assert.NoError(ioutil.WriteFile(blob+".raw", []byte("\x00raw\xff"), 0644))
+
+	resp := httptest.NewRecorder()
+	req, err := http.NewRequest("GET", "/output/sources/ab/cdef.raw", nil)
+	assert.NoError(err)
+	NewSourceServer(dir).ServeHTTP(resp, req)
+	assert.Equal(http.StatusOK, resp.Code)
+	body, _ := ioutil.ReadAll(resp.Result().Body)
+	assert.Equal("\x00raw\xff", string(body))
+}
+
+func TestAcceptsEncoding(t *testing.T) {
+	assert := assert.New(t)
+
+	assert.False(acceptsEncoding("", "gzip"))
+	assert.True(acceptsEncoding("gzip", "gzip"))
+	assert.True(acceptsEncoding("deflate, gzip, br", "gzip"))
+	assert.True(acceptsEncoding("GZIP;q=0.5", "gzip"))
+	assert.False(acceptsEncoding("gzip;q=0", "gzip"))
+	assert.False(acceptsEncoding("gzip; q=0.0, deflate", "gzip"))
+	assert.False(acceptsEncoding("xgzip", "gzip"))
+	assert.False(acceptsEncoding("gzip", "zstd"))
+
+	assert.True(acceptsEncoding("*", "zstd"))
+	assert.False(acceptsEncoding("*;q=0", "zstd"))
+	assert.False(acceptsEncoding("*, zstd;q=0", "zstd"))
+	assert.True(acceptsEncoding("*;q=0, zstd", "zstd"))
+}
+
+func TestRenderAnnotationsStale(t *testing.T) {
+	assert := assert.New(t)
+	dir, err := ioutil.TempDir("", "sbexr-annotations")
+	assert.NoError(err)
+	defer os.RemoveAll(dir)
+
+	cpath := filepath.Join(dir, "file")
+	for _, extension := range []string{".jsrc", ".jann"} {
+		data, err := ioutil.ReadFile("db/testdata/annotations" + extension)
+		assert.NoError(err)
+		assert.NoError(ioutil.WriteFile(cpath+extension, data, 0644))
+	}
+	assert.NoError(ioutil.WriteFile(cpath+".jhtml", []byte("{}"), 0644))
+
+	now := time.Now()
+	for _, extension := range []string{".jsrc", ".jann", ".jhtml"} {
+		assert.NoError(os.Chtimes(cpath+extension, now, now))
+	}
+	_, err = renderAnnotations(cpath)
+	assert.NoError(err)
+
+	// The .jhtml was written again, without --annotations.
+	later := now.Add(time.Second)
+	assert.NoError(os.Chtimes(cpath+".jhtml", later, later))
+	_, err = renderAnnotations(cpath)
+	assert.True(os.IsNotExist(err))
+
+	assert.NoError(os.Chtimes(cpath+".jann", later, later))
+	_, err = renderAnnotations(cpath)
+	assert.True(os.IsNotExist(err), "the .jsrc is still older")
+
+	assert.NoError(os.Chtimes(cpath+".jsrc", later, later))
+	_, err = renderAnnotations(cpath)
+	assert.NoError(err)
+}
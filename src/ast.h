@@ -147,9 +147,7 @@ class SbexrRecorder {
           << MakeIdLink(ntarget);
       return;
     }
-    WrapWithTag(*ci_, cache_, sr,
-                MakeTag("a", {std::string(description) + "-uses"},
-                        {"href", MakeIdLink(ntarget)}));
+    WrapWithTag(*ci_, cache_, sr, MakeUseTag(description, ntarget));
   }
 
   template <typename UserT>
@@ -229,9 +227,7 @@ class SbexrRecorder {
             << MakeIdLink(ntarget);
         return;
       }
-      WrapWithTag(*ci_, cache_, sr,
-                  MakeTag("a", {std::string(description) + "-uses"},
-                          {"href", MakeIdLink(ntarget)}));
+      WrapWithTag(*ci_, cache_, sr, MakeUseTag(description, ntarget));
     }
   }
 
@@ -259,7 +255,7 @@ class SbexrRecorder {
     auto definer_range = NormalizeSourceRange(GetSourceRangeOrFail(definer));
     auto defined_range = NormalizeSourceRange(GetSourceRangeOrFail(defined));
 
-    const auto& id = MakeIdName(definer_range);
+    const auto& id = MakeObjectId(ci_->getSourceManager(), definer_range);
     auto highlight_range =
         NormalizeSourceRange(GetSourceRangeOrFail(highlight));
 
@@ -270,16 +266,15 @@ class SbexrRecorder {
       std::cerr << "  DEFINED " << MakeIdName(defined_range) << " "
                 << PrintLocation(defined_range) << " "
                 << PrintCode(defined_range) << std::endl;
-      std::cerr << "  HIGHLIGHT " << id << " " << PrintLocation(highlight_range)
+      std::cerr << "  HIGHLIGHT " << ::MakeIdName(id) << " "
+                << PrintLocation(highlight_range)
                 << " " << PrintCode(highlight_range) << std::endl;
     }
 
     if (index_->RecordDefines(ci_->getSourceManager(), defined_range,
                               definer_range, kind, name,
                               GetSnippet(definer_range), access, linkage)) {
-      WrapWithTag(
-          *ci_, cache_, highlight_range,
-          MakeTag("span", {"def", std::string("def-") + kind}, {"id", id}));
+      WrapWithTag(*ci_, cache_, highlight_range, MakeDefineTag(kind, id));
     }
   }
 
@@ -293,7 +288,7 @@ class SbexrRecorder {
     auto declarer_range = NormalizeSourceRange(declarer.getSourceRange());
     auto declared_range = NormalizeSourceRange(declared.getSourceRange());
 
-    const auto& id = MakeIdName(declarer_range);
+    const auto& id = MakeObjectId(ci_->getSourceManager(), declarer_range);
     if (gl_verbose) {
       std::cerr << "  DECLARER " << MakeIdName(declarer_range) << " "
                 << PrintLocation(declarer_range) << " "
@@ -306,9 +301,7 @@ class SbexrRecorder {
     if (index_->RecordDeclares(ci_->getSourceManager(), declared_range,
                                declarer_range, kind, name,
                                GetSnippet(declared_range), access, linkage)) {
-      WrapWithTag(
-          *ci_, cache_, declarer_range,
-          MakeTag("span", {"decl", std::string("decl-") + kind}, {"id", id}));
+      WrapWithTag(*ci_, cache_, declarer_range, MakeDeclareTag(kind, id));
     }
   }
 
@@ -337,6 +330,12 @@ class SbexrRecorder {
   }
 
  private:
+  Tag MakeUseTag(const char* description, SourceRange target) {
+    auto& sm = ci_->getSourceManager();
+    return ::MakeUseTag(description,
+                        GetFileHash(cache_->GetFileFor(sm, target.getBegin())),
+                        MakeObjectId(sm, target));
+  }
   std::string MakeIdLink(SourceRange location) {
     auto& sm = ci_->getSourceManager();
     std::string prefix(
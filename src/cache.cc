@@ -49,3 +49,15 @@ Counter& c_empty_path = MakeCounter(
 Counter& c_invalid_fid = MakeCounter(
     "cache/nullreturn/invalid-fid",
     "Returned a nullptr because an invalid FileID was passed to GetFileFor");
+
+void FileCache::StartParsing(const std::string& directory) {
+  last_sm_ = nullptr;
+  last_sm_file_ = nullptr;
+  files_by_uid_.clear();
+  renderer_->SetWorkingPath(directory);
+
+  // Most compile commands of a project run in the same few directories.
+  if (directory == working_path_) return;
+  working_path_ = directory;
+  files_by_path_.clear();
+}
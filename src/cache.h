@@ -34,6 +34,8 @@
 #include "counters.h"
 #include "renderer.h"
 
+#include "llvm/ADT/StringMap.h"
+
 // There are 2 kind of files:
 // - source files, need to be parsed and annotated.
 // - binary files, need to be carried in the output tree, with minimal changes.
@@ -64,12 +66,21 @@ class FileCache {
  public:
   FileCache(FileRenderer* renderer) : renderer_(renderer) {}
 
+  // Must be called before parsing each translation unit, with the directory
+  // the compiler runs in. Relative paths are resolved from that directory,
+  // and FileEntry UIDs are only unique within the FileManager of a single
+  // CompilerInstance, so this drops what is no longer valid.
+  void StartParsing(const std::string& directory);
+
   // Given a path as a string, makes it relative to the output tree.
   // Eg, as the user should see it.
   StringRef GetUserPath(const StringRef& other) const;
 
   // Given a path, return the file descriptor.
   FileRenderer::ParsedFile* GetFileFor(const StringRef& path);
+  // Given a FileEntry of the current CompilerInstance, return the file
+  // descriptor.
+  FileRenderer::ParsedFile* GetFileFor(const FileEntry& entry);
   // Given a FileID, return the file descriptor.
   // IMPORTANT: in clang/llvm, a FileID is generally an entry in a SLocEntry
   // table that can refer to a file, or to a macro expansion. If you obtain
@@ -96,8 +107,12 @@ class FileCache {
                                                SourceLocation end);
 
  private:
-  StringRef last_path_;
-  FileRenderer::ParsedFile* last_path_file_ = nullptr;
+  // Files already resolved by the renderer, so walking the tree is only
+  // necessary the first time a path is seen.
+  StringMap<FileRenderer::ParsedFile*> files_by_path_;
+  std::string working_path_;
+  // Indexed by FileEntry::getUID(), which is small and dense.
+  std::vector<FileRenderer::ParsedFile*> files_by_uid_;
 
   FileID last_id_;
   const SourceManager* last_sm_ = nullptr;
@@ -114,14 +129,23 @@ extern Counter& c_empty_path;
 extern Counter& c_invalid_fid;
 
 inline FileRenderer::ParsedFile* FileCache::GetFileFor(const StringRef& path) {
-  if (path.data() == last_path_.data()) return last_path_file_;
   if (path.empty()) {
     c_empty_path.Add();
     return nullptr;
   }
 
-  last_path_file_ = renderer_->GetFileFor(path);
-  return last_path_file_;
+  auto& file = files_by_path_[path];
+  if (!file) file = renderer_->GetFileFor(path);
+  return file;
+}
+
+inline FileRenderer::ParsedFile* FileCache::GetFileFor(const FileEntry& entry) {
+  const auto uid = entry.getUID();
+  if (uid >= files_by_uid_.size()) files_by_uid_.resize(uid + 1, nullptr);
+
+  auto& file = files_by_uid_[uid];
+  if (!file) file = GetFileFor(entry.getName());
+  return file;
 }
 
 inline FileRenderer::ParsedFile* FileCache::GetFileFor(const SourceManager& sm,
@@ -160,7 +184,7 @@ inline FileRenderer::ParsedFile* FileCache::GetFileFor(const SourceManager& sm,
     return nullptr;
   }
 
-  last_sm_file_ = GetFileFor(cache->OrigEntry->getName());
+  last_sm_file_ = GetFileFor(*cache->OrigEntry);
   return last_sm_file_;
 }
 
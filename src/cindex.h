@@ -48,6 +48,12 @@
 //  + .details - all details of each symbol. Main struct SymbolDetail.
 //  - .files - all files. Main struct FileDetail.
 //
+//  + .fuzzy-names - goes from a mangled (typo'ed) symbol name to the symbol.
+//    Main struct is SymbolFuzzyToName. Sorted by hash, to allow binsearching.
+//  + .components - goes from a component of a qualified name (eg, "method"
+//    in "ns::Class::method") to the symbol. Main struct is
+//    SymbolComponentToName. Sorted by hash, to allow binsearching.
+//
 //  + .json - struct representing the object and hierarchy.
 //
 // Two main lookups for details:
@@ -112,6 +118,43 @@ typedef struct {
   DetailOffsetT Detailoffset;
 } SymbolHashToDetails;
 
+// In .fuzzy-names file.
+// Sorted by hash value, then by name offset. Looked up by hash value.
+//
+// This is a symmetric deletion index: for each symbol name, the name is
+// lowercased, and the 32 bit FNV-1a hash of the name itself and of every
+// variant obtained by deleting up to N characters (N being the edit distance
+// the index was built with, generally 1 or 2) is stored here.
+//
+// To find all symbols within edit distance N of a query, compute the same
+// set of variants for the query, look up each hash, and verify the distance
+// on the names found (hashes are only 32 bits, and deletions are lossy).
+typedef struct {
+  uint32_t hash;
+  NameOffsetT nameoffset;
+} SymbolFuzzyToName;
+
+// In .components file.
+// Sorted by hash value, then depth, then name offset. Looked up by hash value.
+//
+// Qualified names are split on "::" (ignoring any "::" within template
+// arguments or parameter lists). For each component, the 32 bit FNV-1a hash
+// of the lowercased component is stored, with its depth (0 for the outermost
+// component) and the total number of components in the name. For example,
+// "any method named Lookup" is every entry with the hash of "lookup" and
+// depth == components - 1.
+//
+// Names made of a single component have a single entry, with depth 0 and
+// components 1. Names with more than 255 components are not included.
+typedef struct {
+  uint32_t hash;
+  NameOffsetT nameoffset;
+  uint8_t depth;
+  uint8_t components;
+  // Always 0, so the file content is reproducible.
+  uint8_t pad[2];
+} SymbolComponentToName;
+
 // In .id-details file.
 // Sorted by filehash, sid, eid. Looked up by symbol::Id.
 typedef struct {
@@ -157,6 +200,64 @@ typedef struct {
   const SymbolDetailKind kind[];
 } SymbolDetail;
 
+// The only element in a .jlines file, next to the .jhtml of parsed sources.
+//
+// offset[n] is the offset in the .jhtml file of the beginning of line n
+// (starting from 0) of the source, offset[lines] is the end of the html.
+// If pagelines is not 0, the html from offset[n * pagelines] to
+// offset[(n + 1) * pagelines] (or the end) has all its tags closed, so
+// a page can be served on its own.
+typedef struct {
+  uint32_t lines;
+  uint32_t pagelines;
+
+  const uint64_t offset[];
+} LineIndex;
+
+// With --annotations, parsed sources are not rendered as html. Their .jhtml
+// file only has the navbar, and next to it:
+//  + .jsrc - the source, as is.
+//  + .jann - the tags to apply to the source. An AnnotationHeader, followed
+//    by the Annotation, the AnnotationTarget and the classes, each class as
+//    a uint16_t length followed by the (not terminated) name.
+//
+// The html is built the same way sbexr would: each Annotation is an element
+// of the given kind wrapping the range, with the class (and keyword, link
+// or id) as attributes. Annotations are opened in the order they are stored,
+// and closed in the reverse order, closes before opens at the same offset.
+enum AnnotationKindT {
+  kAnnotationSpan,     // <span class='CLASS'>
+  kAnnotationKeyword,  // <span class='CLASS KEYWORD'>
+  kAnnotationUse,      // <a class='CLASS-uses' href='FILE#ID'>
+  kAnnotationDefine,   // <span class='def def-CLASS' id='ID'>
+  kAnnotationDeclare,  // <span class='decl decl-CLASS' id='ID'>
+  kAnnotationInclude,  // <a class='CLASS' href='FILE'>
+};
+
+typedef struct {
+  uint32_t annotations;
+  uint32_t targets;
+  uint32_t classes;
+  uint32_t sourcesize;
+} AnnotationHeader;
+
+// Sorted by offset, then longest first.
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+  uint8_t kind;
+  uint8_t flags;
+  // Index of the class name.
+  uint16_t classes;
+  // Index of the AnnotationTarget, unused by spans and keywords.
+  uint32_t target;
+} Annotation;
+
+typedef struct {
+  uint64_t filehash;
+  SymbolId sid;
+} AnnotationTarget;
+
 #pragma GCC diagnostic push
 
 #endif /* CINDEX_H */
@@ -27,6 +27,25 @@
 // policies, either expressed or implied, of Carlo Contavalli.
 
 #include "common.h"
+#include "writer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 std::string MakeOutputPath(uint64_t hash, const char* extension) {
   const auto& hex = ToHex(hash);
@@ -37,11 +56,24 @@ std::string MakeOutputPath(uint64_t hash, const char* extension) {
 std::string MakeHtmlPath(uint64_t hash, const char* extension) {
   return JoinPath({{"..", 2}, MakeOutputPath(hash, extension)});
 }
+static std::string output_dir = "output/sources";
+
+void SetOutputDir(const std::string& dir) { output_dir = dir; }
+const std::string& GetOutputDir() { return output_dir; }
+
 std::string MakeSourcePath(uint64_t hash, const char* extension) {
-  return JoinPath({"output", "sources", MakeOutputPath(hash, extension)});
+  return JoinPath({output_dir, MakeOutputPath(hash, extension)});
 }
 std::string MakeMetaPath(const std::string& filename) {
-  return JoinPath({"output", "sources", "meta", filename});
+  return JoinPath({output_dir, "meta", filename});
+}
+
+std::string MakeIdName(const ObjectId& objid) {
+  if (objid.sl == 0) return ToHex(objid.el);
+  if (objid.sl == objid.el) return ToHex(objid.el);
+  return (ToHex(objid.sl).operator StringRef() +
+          ToHex(objid.el).operator StringRef())
+      .str();
 }
 
 // Creates all the directories up to the last /.
@@ -49,16 +81,26 @@ std::string MakeMetaPath(const std::string& filename) {
 // Example: MakeDirs("/etc/defaults/test", 0777) will ensure that
 // "/etc", "/etc/defaults" exist, so the test file can be created.
 bool MakeDirs(const std::string& path, int mode) {
-  std::string copy(path);
+  static std::mutex lock;
+  static std::unordered_set<std::string> created;
 
-  for (std::size_t index = 1;
-       (index = copy.find('/', index)) != std::string::npos;) {
-    copy[index] = '\0';
-    if (mkdir(copy.c_str(), mode) && errno != EEXIST) return false;
+  const auto slash = path.rfind('/');
+  if (slash == std::string::npos || slash == 0) return true;
+  const auto& dirname = path.substr(0, slash);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (created.count(dirname)) return true;
+  }
 
-    copy[index] = '/';
-    index = index + 1;
+  // Try the directory itself first: in an output tree being filled, the
+  // parents almost always exist already, so this is a single mkdir().
+  if (mkdir(dirname.c_str(), mode) && errno != EEXIST) {
+    if (errno != ENOENT || !MakeDirs(dirname, mode)) return false;
+    if (mkdir(dirname.c_str(), mode) && errno != EEXIST) return false;
   }
+
+  std::lock_guard<std::mutex> guard(lock);
+  created.insert(dirname);
   return true;
 }
 // Creates all the directories specified.
@@ -73,6 +115,412 @@ bool MakeAllDirs(const std::string& path, int mode) {
   return true;
 }
 
+static int RemoveEntry(const char* path, const struct stat*, int,
+                       struct FTW*) {
+  if (remove(path) < 0) {
+    std::cerr << "WARNING: could not remove " + std::string(path) + ": " +
+                     strerror(errno) + "\n";
+  }
+  return 0;
+}
+
+void RemoveTree(const std::string& path) {
+  nftw(path.c_str(), RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// A single syncfs() for the whole filesystem of path, rather than an
+// fsync() per file.
+static bool SyncFilesystem(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || syncfs(fd) < 0) {
+    std::cerr << "ERROR: could not sync " + path + ": " + strerror(errno) +
+                     "\n";
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// Makes renames within directory durable.
+static void SyncDirectory(const std::string& directory) {
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+bool CommitOutputDir(const std::string& path) {
+  const auto& staging = GetOutputDir();
+  if (!SyncFilesystem(staging)) return false;
+
+  if (!MakeDirs(path, 0777)) {
+    std::cerr << "ERROR: FAILED TO MAKE DIRS FOR '" + path + "'\n";
+    return false;
+  }
+
+  bool swapped = false;
+#if defined(SYS_renameat2) && defined(RENAME_EXCHANGE)
+  swapped = syscall(SYS_renameat2, AT_FDCWD, staging.c_str(), AT_FDCWD,
+                    path.c_str(), RENAME_EXCHANGE) == 0;
+#endif
+  if (!swapped) {
+    // No previous output, or no RENAME_EXCHANGE: there is a short window
+    // in which path does not exist.
+    const auto& old = path + ".old";
+    RemoveTree(old);
+    if (rename(path.c_str(), old.c_str()) < 0 && errno != ENOENT) {
+      std::cerr << "ERROR: could not rename " + path + ": " +
+                       strerror(errno) + "\n";
+      return false;
+    }
+    if (rename(staging.c_str(), path.c_str()) < 0) {
+      std::cerr << "ERROR: could not rename " + staging + " to " + path +
+                       ": " + strerror(errno) + "\n";
+      return false;
+    }
+    RemoveTree(old);
+  } else {
+    RemoveTree(staging);
+  }
+
+  const auto slash = path.rfind('/');
+  SyncDirectory(slash == std::string::npos ? "." : path.substr(0, slash));
+  SetOutputDir(path);
+  return true;
+}
+
+bool CommitStagedFiles(const std::string& staging, const std::string& dir,
+                       const std::string& last) {
+  if (!SyncFilesystem(staging)) return false;
+
+  DIR* listing = opendir(staging.c_str());
+  if (!listing) {
+    std::cerr << "ERROR: could not open dir " + staging + ": " +
+                     strerror(errno) + "\n";
+    return false;
+  }
+  std::vector<std::string> names;
+  while (const auto* entry = readdir(listing)) {
+    if (entry->d_type == DT_DIR) continue;
+    names.emplace_back(entry->d_name);
+  }
+  closedir(listing);
+
+  const auto IsLast = [&last](const std::string& name) {
+    return name.size() >= last.size() &&
+           name.compare(name.size() - last.size(), last.size(), last) == 0;
+  };
+  std::stable_partition(names.begin(), names.end(),
+                        [&IsLast](const std::string& name) {
+                          return !IsLast(name);
+                        });
+
+  bool result = true;
+  for (const auto& name : names) {
+    const auto& from = JoinPath({staging, name});
+    const auto& to = JoinPath({dir, name});
+    if (rename(from.c_str(), to.c_str()) < 0) {
+      std::cerr << "ERROR: could not rename " + from + " to " + to + ": " +
+                       strerror(errno) + "\n";
+      result = false;
+    }
+  }
+  SyncDirectory(dir);
+  if (result) RemoveTree(staging);
+  return result;
+}
+
+void RunParallel(size_t size, unsigned jobs,
+                 const std::function<void(size_t)>& work) {
+  if (!jobs) jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  jobs = std::min<size_t>(jobs, size);
+  if (jobs <= 1) {
+    for (size_t index = 0; index < size; ++index) work(index);
+    return;
+  }
+
+  std::atomic<size_t> next{0};
+  auto Worker = [&next, size, &work]() {
+    for (size_t index; (index = next.fetch_add(1)) < size;) work(index);
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs; ++i) threads.emplace_back(Worker);
+  Worker();
+  for (auto& thread : threads) thread.join();
+}
+
+// Copies what is left of in to out, within the kernel when possible.
+static bool CopyFileData(int in, int out) {
+#ifdef SYS_copy_file_range
+  while (true) {
+    auto copied = syscall(SYS_copy_file_range, in, nullptr, out, nullptr,
+                          1 << 30, 0);
+    if (copied < 0 && errno == EINTR) continue;
+    if (copied == 0) return true;
+    // Not supported, or across filesystems on older kernels.
+    if (copied < 0) break;
+  }
+#endif
+
+  while (true) {
+    auto copied = sendfile(out, in, nullptr, 1 << 30);
+    if (copied < 0 && errno == EINTR) continue;
+    if (copied == 0) return true;
+    if (copied < 0) break;
+  }
+
+  char buffer[64 * 1024];
+  while (true) {
+    auto size = read(in, buffer, sizeof(buffer));
+    if (size < 0 && errno == EINTR) continue;
+    if (size <= 0) return size == 0;
+
+    for (const char* data = buffer; size > 0;) {
+      auto written = write(out, data, size);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return false;
+      data += written;
+      size -= written;
+    }
+  }
+}
+
+bool LinkOrCopyFile(const std::string& from, const std::string& to,
+                    bool link) {
+  unlink(to.c_str());
+  if (link && ::link(from.c_str(), to.c_str()) == 0) return true;
+
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    std::cerr << "ERROR: could not open " + from + ": " + strerror(errno) +
+                     "\n";
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    std::cerr << "ERROR: could not create " + to + ": " + strerror(errno) +
+                     "\n";
+    close(in);
+    return false;
+  }
+
+  bool copied = false;
+#ifdef FICLONE
+  copied = ioctl(out, FICLONE, in) == 0;
+#endif
+  if (!copied) copied = CopyFileData(in, out);
+  if (!copied) {
+    std::cerr << "ERROR: could not copy " + from + " to " + to + ": " +
+                     strerror(errno) + "\n";
+  }
+
+  close(in);
+  if (close(out) != 0) copied = false;
+  if (!copied) unlink(to.c_str());
+  return copied;
+}
+
+static bool WriteGzip(StringRef data, const std::string& path) {
+  z_stream stream = {};
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    std::cerr << "ERROR: could not initialize zlib for " + path + "\n";
+    return false;
+  }
+
+  FileWriter output;
+  if (!output.Open(path)) {
+    deflateEnd(&stream);
+    return false;
+  }
+
+  // avail_in is an unsigned int, feed the data in chunks.
+  constexpr size_t kChunkSize = 1 << 30;
+  const char* next = data.data();
+  size_t left = data.size();
+  char buffer[64 * 1024];
+  int result = Z_OK;
+  while (result == Z_OK) {
+    if (stream.avail_in == 0 && left > 0) {
+      const auto chunk = std::min(left, kChunkSize);
+      stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(next));
+      stream.avail_in = chunk;
+      next += chunk;
+      left -= chunk;
+    }
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    result = deflate(&stream, left > 0 ? Z_NO_FLUSH : Z_FINISH);
+    output.append(buffer, sizeof(buffer) - stream.avail_out);
+  }
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END) {
+    std::cerr << "ERROR: could not compress " + path + "\n";
+    output.Close();
+    unlink(path.c_str());
+    return false;
+  }
+  return output.Close();
+}
+
+#ifdef HAVE_ZSTD
+static bool WriteZstd(StringRef data, const std::string& path) {
+  std::unique_ptr<char[]> buffer(new char[ZSTD_compressBound(data.size())]);
+  const auto size = ZSTD_compress(buffer.get(), ZSTD_compressBound(data.size()),
+                                  data.data(), data.size(),
+                                  gl_precompress_level);
+  if (ZSTD_isError(size)) {
+    std::cerr << "ERROR: could not compress " + path + ": " +
+                     ZSTD_getErrorName(size) + "\n";
+    return false;
+  }
+
+  FileWriter output;
+  if (!output.Open(path)) return false;
+  output.append(buffer.get(), size);
+  return output.Close();
+}
+#endif
+
+bool PrecompressFile(const std::string& path) {
+  MappedFile input;
+  if (!input.Open(path)) return false;
+
+  bool result = WriteGzip(input.data(), path + ".gz");
+#ifdef HAVE_ZSTD
+  result = WriteZstd(input.data(), path + ".zst") && result;
+#endif
+  return result;
+}
+
+void RemovePrecompressed(const std::string& path) {
+  unlink((path + ".gz").c_str());
+  unlink((path + ".zst").c_str());
+}
+
+bool MappedFile::Open(const std::string& path) {
+  return Open(AT_FDCWD, path);
+}
+
+bool MappedFile::Open(int dirfd, const std::string& path) {
+  Close();
+
+  int fd = openat(dirfd, path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "ERROR: could not open " + path + ": " + strerror(errno) +
+                     "\n";
+    return false;
+  }
+
+  struct stat stats;
+  if (fstat(fd, &stats) != 0) {
+    std::cerr << "ERROR: could not stat " + path + ": " + strerror(errno) +
+                     "\n";
+    close(fd);
+    return false;
+  }
+
+  // mmap() fails on empty files.
+  if (stats.st_size > 0) {
+    void* data = mmap(nullptr, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      std::cerr << "ERROR: could not map " + path + ": " + strerror(errno) +
+                       "\n";
+      close(fd);
+      return false;
+    }
+    madvise(data, stats.st_size, MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(data);
+    size_ = stats.st_size;
+  }
+  close(fd);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_) munmap(const_cast<char*>(data_), size_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+NameMatcher::NameMatcher(const std::string& regex) : empty_(regex.empty()) {
+  if (empty_ || ParseLiterals(regex)) return;
+  literals_.clear();
+  regex_.reset(new std::regex(regex));
+}
+
+bool NameMatcher::ParseLiterals(const std::string& regex) {
+  Literal literal;
+  for (size_t i = 0; i <= regex.size(); ++i) {
+    const char c = i < regex.size() ? regex[i] : '|';
+    switch (c) {
+      case '|':
+        if (literal.text.empty()) return false;
+        literals_.push_back(std::move(literal));
+        literal = Literal();
+        break;
+
+      case '^':
+        if (!literal.text.empty() || literal.begin) return false;
+        literal.begin = true;
+        break;
+
+      case '$':
+        if (i + 1 < regex.size() && regex[i + 1] != '|') return false;
+        literal.end = true;
+        break;
+
+      case '\\':
+        // Only escaped punctuation is a literal, \d, \w, \b, ... are not.
+        if (++i >= regex.size() ||
+            !ispunct(static_cast<unsigned char>(regex[i])))
+          return false;
+        literal.text.push_back(regex[i]);
+        break;
+
+      case '.':
+      case '*':
+      case '+':
+      case '?':
+      case '(':
+      case ')':
+      case '[':
+      case ']':
+      case '{':
+      case '}':
+        return false;
+
+      default:
+        literal.text.push_back(c);
+        break;
+    }
+  }
+  return true;
+}
+
+bool NameMatcher::Matches(StringRef name) const {
+  if (empty_) return false;
+  if (regex_)
+    return std::regex_search(name.begin(), name.end(), *regex_);
+
+  for (const auto& literal : literals_) {
+    if (literal.begin && literal.end) {
+      if (name == literal.text) return true;
+    } else if (literal.begin) {
+      if (name.startswith(literal.text)) return true;
+    } else if (literal.end) {
+      if (name.endswith(literal.text)) return true;
+    } else if (name.find(literal.text) != StringRef::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
 std::string GetCwd() {
   std::string buffer(1024, '\0');
   while (getcwd(&buffer[0], buffer.size()) == nullptr) {
@@ -31,11 +31,16 @@
 
 #include "base.h"
 
+#include <functional>
+
 // Category for all relevant flags.
 extern cl::OptionCategory gl_category;
 
 extern cl::opt<std::string> gl_tag;
 extern cl::opt<bool> gl_verbose;
+extern cl::opt<bool> gl_precompress;
+extern cl::opt<int> gl_precompress_level;
+extern cl::opt<bool> gl_incremental_output;
 
 // Returns a path like xx/yyyy.html.
 // Used to compute other paths.
@@ -45,7 +50,7 @@ std::string MakeOutputPath(uint64_t hash, const char* extension = ".html");
 // Used to fill href= fields or generally links in html / css / js files.
 std::string MakeHtmlPath(uint64_t hash, const char* extension = ".html");
 
-// Returns a path like output/sources/xx/yyyy.html.
+// Returns a path like output/sources/xx/yyyy.html, see SetOutputDir.
 // Used by the generator to write out the source files.
 std::string MakeSourcePath(uint64_t hash, const char* extension = ".html");
 
@@ -53,6 +58,31 @@ std::string MakeSourcePath(uint64_t hash, const char* extension = ".html");
 // Used to generate meta index files and similar.
 std::string MakeMetaPath(const std::string& path);
 
+// Identifies an object in a file by its spelling (sl) and expansion (el)
+// locations, see MakeObjectId.
+struct ObjectId {
+  uint64_t sl;
+  uint64_t el;
+
+  bool operator==(const ObjectId& other) const {
+    return sl == other.sl && el == other.el;
+  }
+  bool operator<(const ObjectId& other) const {
+    if (sl == other.sl) return el < other.el;
+    return sl < other.sl;
+  }
+};
+
+static inline std::ostream& operator<<(std::ostream& stream,
+                                       const ObjectId& objid) {
+  stream << objid.sl;
+  stream << objid.el;
+  return stream;
+}
+
+// Returns the name used in id= attributes and links for the object.
+std::string MakeIdName(const ObjectId& objid);
+
 // Some declarations / objects don't have a valid end range.
 // Generally, it is implicitly declared methods, like implicit
 // constructors or copy operators.
@@ -66,11 +96,97 @@ std::string GetSourceRange(const SourceManager& sm, const SourceRange& range);
 
 // Create all directories in path.
 // Last element of the path name assumed to be a file.
+// Directories created are remembered, so it is cheap to call for every file
+// in the same directory. Safe to call from multiple threads.
 bool MakeDirs(const std::string& path, int mode);
 // Create all directories in path, including last element.
 bool MakeAllDirs(const std::string& path, int mode);
 // Returns the current working directory.
 std::string GetCwd();
+// Removes path and everything below it, without following symlinks.
+void RemoveTree(const std::string& path);
+
+// Directory MakeSourcePath and MakeMetaPath are relative to, output/sources
+// unless changed. Not thread safe, to be set before generating files.
+void SetOutputDir(const std::string& dir);
+const std::string& GetOutputDir();
+// Syncs to disk the files in the output directory, and then replaces path
+// with it, as atomically as the system allows. The output directory becomes
+// path.
+bool CommitOutputDir(const std::string& path);
+// Syncs to disk the files in staging, and moves them in dir, replacing the
+// files with the same name. The files whose name ends with last are moved
+// after all the others. staging is removed if all moves succeed.
+bool CommitStagedFiles(const std::string& staging, const std::string& dir,
+                       const std::string& last);
+
+// Calls work(index) for each index in [0, size), from jobs threads, or one
+// per core if jobs is 0. Indexes are handed out in order from a shared
+// counter, so threads done with cheap items keep taking the remaining ones.
+void RunParallel(size_t size, unsigned jobs,
+                 const std::function<void(size_t)>& work);
+
+// Copies the file from to the path to, replacing it if it exists. If link
+// is true, to is made a hard link to from when possible. Otherwise, or if
+// linking fails, the copy is made by cloning the file (on filesystems that
+// support it), then with copy_file_range() or sendfile(), and only then
+// with read / write.
+bool LinkOrCopyFile(const std::string& from, const std::string& to,
+                    bool link);
+
+// Writes a copy of path compressed with gzip in path.gz, and with zstd in
+// path.zst when built with HAVE_ZSTD, so they can be served as is.
+bool PrecompressFile(const std::string& path);
+// Removes the copies of path PrecompressFile may have written, so they are
+// never served in place of a newer path.
+void RemovePrecompressed(const std::string& path);
+
+// A whole file, mapped read only in memory.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile() { Close(); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool Open(const std::string& path);
+  // Opens name, relative to the directory open as dirfd.
+  bool Open(int dirfd, const std::string& name);
+  void Close();
+
+  StringRef data() const { return StringRef(data_, size_); }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Matches names against a regex, compiled once.
+//
+// Regexes made only of alternatives of literal strings, each optionally
+// anchored with ^ or $ (like \.swp$|^\.git$), are matched with plain
+// string compares, without std::regex. Anything else falls back to
+// std::regex_search.
+class NameMatcher {
+ public:
+  explicit NameMatcher(const std::string& regex);
+
+  bool Matches(StringRef name) const;
+
+ private:
+  struct Literal {
+    std::string text;
+    bool begin = false;
+    bool end = false;
+  };
+  // Parses regex as alternatives of literals, returns false if it is not.
+  bool ParseLiterals(const std::string& regex);
+
+  bool empty_;
+  std::vector<Literal> literals_;
+  std::unique_ptr<std::regex> regex_;
+};
 
 template <typename T>
 struct HexConverted;
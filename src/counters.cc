@@ -45,7 +45,8 @@ Counter& MakeCounter(const char* path, const char* description) {
 
 Counter& Register::MakeCounter(const char* path, const char* description) {
   auto result = counters_.emplace(
-      std::pair<std::string, Counter>(path, {path, description, NullStream()}));
+      std::piecewise_construct, std::forward_as_tuple(path),
+      std::forward_as_tuple(path, description, NullStream()));
   return result.first->second;
 }
 
@@ -31,6 +31,7 @@
 
 #include "common.h"
 
+#include <atomic>
 #include <map>
 #include <ostream>
 #include <string>
@@ -66,6 +67,8 @@ class Counter {
   DebugStream Add();
   DebugStream Add(SourceRange range);
   DebugStream Add(SourceLocation begin, SourceLocation end);
+  // Adds value to the counter, without logging to the capture stream.
+  void Increment(uint64_t value) { counter_ += value; }
 
   void Capture(std::ostream* capture);
 
@@ -75,7 +78,8 @@ class Counter {
   const std::string name_;
   const std::string description_;
   std::ostream* capture_;
-  uint64_t counter_ = 0;
+  // Counters are updated while outputting files from multiple threads.
+  std::atomic<uint64_t> counter_{0};
 };
 
 class Register {
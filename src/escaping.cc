@@ -0,0 +1,96 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#include "escaping.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SBEXR_X86_ESCAPING
+#endif
+
+static const char* FindHtmlSpecialScalar(const char* data, const char* end) {
+  for (; data < end; ++data)
+    if (*data == '&' || *data == '<' || *data == '>') return data;
+  return end;
+}
+
+#ifdef SBEXR_X86_ESCAPING
+__attribute__((target("sse2"))) static const char* FindHtmlSpecialSse2(
+    const char* data, const char* end) {
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+
+  for (; end - data >= 16; data += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    const __m128i found =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, amp),
+                                  _mm_cmpeq_epi8(chunk, lt)),
+                     _mm_cmpeq_epi8(chunk, gt));
+    const int mask = _mm_movemask_epi8(found);
+    if (mask) return data + __builtin_ctz(mask);
+  }
+  return FindHtmlSpecialScalar(data, end);
+}
+
+__attribute__((target("avx2"))) static const char* FindHtmlSpecialAvx2(
+    const char* data, const char* end) {
+  const __m256i amp = _mm256_set1_epi8('&');
+  const __m256i lt = _mm256_set1_epi8('<');
+  const __m256i gt = _mm256_set1_epi8('>');
+
+  for (; end - data >= 32; data += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    const __m256i found =
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp),
+                                        _mm256_cmpeq_epi8(chunk, lt)),
+                        _mm256_cmpeq_epi8(chunk, gt));
+    const unsigned mask = _mm256_movemask_epi8(found);
+    if (mask) return data + __builtin_ctz(mask);
+  }
+  return FindHtmlSpecialSse2(data, end);
+}
+#endif
+
+using FindHtmlSpecialFunction = const char* (*)(const char*, const char*);
+
+static FindHtmlSpecialFunction SelectFindHtmlSpecial() {
+#ifdef SBEXR_X86_ESCAPING
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FindHtmlSpecialAvx2;
+  if (__builtin_cpu_supports("sse2")) return FindHtmlSpecialSse2;
+#endif
+  return FindHtmlSpecialScalar;
+}
+
+const char* FindHtmlSpecial(const char* data, const char* end) {
+  static const FindHtmlSpecialFunction find = SelectFindHtmlSpecial();
+  return find(data, end);
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#ifndef ESCAPING_H
+#define ESCAPING_H
+
+#include "base.h"
+
+#include <string>
+
+// Returns a pointer to the first '&', '<' or '>' in [data, end), or end if
+// there is none. Uses SSE2 or AVX2 when the cpu supports them.
+const char* FindHtmlSpecial(const char* data, const char* end);
+
+// Appends size bytes from data to output, escaping the characters that
+// have a meaning in html. Text without special characters is appended in
+// bulk. OutputT needs an append(const char*, size_t) method.
+template <typename OutputT>
+void AppendEscapedHtml(OutputT* output, const char* data, size_t size) {
+  const char* end = data + size;
+  while (data < end) {
+    const char* special = FindHtmlSpecial(data, end);
+    output->append(data, special - data);
+    if (special >= end) break;
+
+    switch (*special) {
+      case '&':
+        output->append("&amp;", 5);
+        break;
+      case '<':
+        output->append("&lt;", 4);
+        break;
+      case '>':
+        output->append("&gt;", 4);
+        break;
+    }
+    data = special + 1;
+  }
+}
+
+// Same as html::EscapeText with default arguments: returns text with '&',
+// '<' and '>' escaped.
+static inline std::string EscapeHtml(const StringRef& text) {
+  std::string escaped;
+  escaped.reserve(text.size());
+  AppendEscapedHtml(&escaped, text.data(), text.size());
+  return escaped;
+}
+
+#endif /* ESCAPING_H */
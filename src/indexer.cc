@@ -28,9 +28,12 @@
 
 #include "indexer.h"
 #include "counters.h"
+#include "sharedpool.h"
 
 #include "json-helpers.h"
 
+#include <fcntl.h>
+
 auto& c_invalid_object_id = MakeCounter(
     "indexer/object-id/invalid-file",
     "Link lead to an #invalid-id, as there was no file set in the Id objecT");
@@ -54,6 +57,23 @@ auto& c_discarded_use_file =
     MakeCounter("indexer/record/use/invalid-file",
                 "Ranges passed to RecordUse refer to an invalid file");
 
+cl::opt<int> gl_fuzzy_distance(
+    "fuzzy-distance",
+    cl::desc("Maximum edit distance of the typo tolerant symbol index. "
+             "0 disables the index, the maximum supported is 2."),
+    cl::value_desc("distance"), cl::init(1), cl::cat(gl_category));
+cl::opt<std::string> gl_shared_pool_dir(
+    "shared-pool-dir",
+    cl::desc("Directory with the string, snippet and file pools to share "
+             "across the indexes of multiple tags. Pools are extended with "
+             "whatever is missing, and the index links to them."),
+    cl::value_desc("directory"), cl::cat(gl_category));
+cl::opt<bool> gl_mmap_pools(
+    "mmap-pools",
+    cl::desc("Keep the string and snippet pools in files mapped in memory in "
+             "the index directory, rather than in anonymous memory."),
+    cl::cat(gl_category), cl::init(true));
+
 const char _kIndexString[] = "Generic";
 const char _kSnippetString[] = "Snippet";
 const char _kNameString[] = "Name";
@@ -185,14 +205,159 @@ class JsonWriter {
 };
 
 template <typename MemPoolT>
-void OutputPool(const char* path, const MemPoolT& mempool) {
-  std::ofstream myfile;
-  myfile.open(
-      path, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+void OutputPool(const char* path, MemPoolT* mempool) {
+  // A previous run may have left a link to a shared pool here, don't
+  // truncate the shared pool by writing through it.
+  unlink(path);
+  if (mempool->Finalize(path)) return;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "ERROR: could not open " << path << ": " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  mempool->Dump(fd);
+  close(fd);
+}
+
+// Symbols longer than this are not added to the fuzzy index. The number of
+// variants grows with the square of the length, and long names are rarely
+// typed by hand anyway.
+static constexpr size_t kFuzzyMaxLength = 64;
+// Symbols longer than this only get variants within edit distance 1.
+static constexpr size_t kFuzzyMaxDistance2Length = 24;
+
+static inline uint32_t Fnv1a32(uint32_t state, const char* data, size_t size) {
+  for (const char* end = data + size; data < end; ++data) {
+    state ^= static_cast<uint8_t>(*data);
+    state *= 0x01000193;
+  }
+  return state;
+}
+
+// Computes the symmetric deletion variants of name, as described in cindex.h,
+// and appends them to variants.
+static void AddFuzzyVariants(const NameString& name, NameOffsetT offset,
+                             int distance,
+                             std::vector<SymbolFuzzyToName>* variants) {
+  const size_t size = name.size();
+  if (distance <= 0 || size > kFuzzyMaxLength) return;
+  if (size > kFuzzyMaxDistance2Length) distance = 1;
+
+  char folded[kFuzzyMaxLength];
+  for (size_t i = 0; i < size; ++i)
+    folded[i] = tolower(static_cast<unsigned char>(name.data()[i]));
+
+  // prefix[i] is the state of the hash after the first i characters, so
+  // computing each variant only requires hashing what follows the deletion.
+  uint32_t prefix[kFuzzyMaxLength + 1];
+  prefix[0] = 0x811c9dc5;
+  for (size_t i = 0; i < size; ++i)
+    prefix[i + 1] = Fnv1a32(prefix[i], &folded[i], 1);
+
+  variants->push_back({prefix[size], offset});
+  for (size_t i = 0; i < size; ++i) {
+    variants->push_back(
+        {Fnv1a32(prefix[i], &folded[i + 1], size - i - 1), offset});
+    if (distance < 2) continue;
+
+    // state is the hash of the name up to j, with character i deleted.
+    uint32_t state = prefix[i];
+    for (size_t j = i + 1; j < size; ++j) {
+      variants->push_back(
+          {Fnv1a32(state, &folded[j + 1], size - j - 1), offset});
+      state = Fnv1a32(state, &folded[j], 1);
+    }
+  }
+}
+
+// Splits a qualified name like "ns::Class<a::b>::method" in its components,
+// and appends one entry per component to components.
+static void AddNameComponents(const NameString& name, NameOffsetT offset,
+                              std::vector<SymbolComponentToName>* components) {
+  const char* data = name.data();
+  const size_t size = name.size();
+
+  std::vector<std::pair<size_t, size_t>> ranges;
+  int nesting = 0;
+  size_t start = 0;
+  for (size_t i = 0; i < size; ++i) {
+    switch (data[i]) {
+      case '<':
+      case '(':
+        ++nesting;
+        break;
+      case '>':
+      case ')':
+        // Keeps things like "operator>" from confusing the splitting.
+        if (nesting > 0) --nesting;
+        break;
+      case ':':
+        if (nesting || i + 1 >= size || data[i + 1] != ':') break;
+        ranges.emplace_back(start, i);
+        start = i + 2;
+        ++i;
+        break;
+    }
+  }
+  ranges.emplace_back(start, size);
+
+  // Dropping components would make depth == components - 1 match the wrong
+  // one, skip the name instead.
+  const auto total = ranges.size();
+  if (total > std::numeric_limits<uint8_t>::max()) return;
+  for (size_t depth = 0; depth < total; ++depth) {
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = ranges[depth].first; i < ranges[depth].second; ++i) {
+      const char lower = tolower(static_cast<unsigned char>(data[i]));
+      hash = Fnv1a32(hash, &lower, 1);
+    }
+    components->push_back({hash, offset, static_cast<uint8_t>(depth),
+                           static_cast<uint8_t>(total), {0, 0}});
+  }
+}
 
-  const auto& storage = mempool.GetStorage();
+// RecordSizer for the records in a .files pool.
+static size_t FileRecordSize(const char* data, size_t available) {
+  uint16_t pathsize;
+  if (available < sizeof(FileDetail)) return 0;
+  memcpy(&pathsize, data + offsetof(FileDetail, pathsize), sizeof(pathsize));
+  if (available - sizeof(FileDetail) < pathsize) return 0;
+  return sizeof(FileDetail) + pathsize;
+}
+
+// Returns the offset to use in the index to refer to str: the offset in the
+// shared or repacked pool if one is in use, the offset in the pool of the
+// string otherwise. translated caches the offsets already looked up.
+template <typename StringT>
+static uint32_t GetPoolOffset(
+    SharedPool* shared, google::sparse_hash_map<uint32_t, uint32_t>* translated,
+    const StringT& str) {
+  if (!shared) return str.GetOffset();
+
+  auto found = translated->find(str.GetOffset());
+  if (found != translated->end()) return found->second;
+
+  uint32_t offset = 0;
+  shared->Add(StringT::GetPool()->Get(str.GetOffset()),
+              sizeof(uint32_t) + str.size(), &offset);
+  translated->insert(std::make_pair(str.GetOffset(), offset));
+  return offset;
+}
 
-  myfile.write(storage.data(), storage.size());
+// Returns an empty pool written at path, to copy strings into in the order
+// they are output. nullptr if the pool could not be opened.
+static std::unique_ptr<SharedPool> OpenRepackedPool(const std::string& path) {
+  unlink(path.c_str());
+  auto pool =
+      llvm::make_unique<SharedPool>(path, SharedPool::StringRecordSize);
+  if (!pool->Open()) {
+    std::cerr << "ERROR: could not repack " << path
+              << ", output will depend on thread scheduling" << std::endl;
+    return nullptr;
+  }
+  return pool;
 }
 
 void Indexer::OutputJsonIndex(const char* path) {
@@ -339,6 +504,23 @@ void Indexer::OutputJsonIndex(const char* path) {
   }
 }
 
+static std::string IndexBasename(const char* tag) {
+  return tag ? std::string("index.") + tag : "index";
+}
+
+void Indexer::MapPoolsToFiles(const char* path, const char* tag) {
+  if (!gl_mmap_pools) return;
+  if (!MakeAllDirs(path, 0777)) {
+    std::cerr << "FAILED TO MAKE INDEX PATH '" << path << "'" << std::endl;
+    return;
+  }
+
+  const std::string basename = IndexBasename(tag);
+  SnippetString::GetPool()->MapToFile(
+      JoinPath({path, basename + ".snippets"}));
+  IndexString::GetPool()->MapToFile(JoinPath({path, basename + ".strings"}));
+}
+
 void Indexer::OutputBinaryIndex(const char* path, const char* tag) {
   struct LinkageKind {
     bool operator<(const LinkageKind& other) const {
@@ -419,14 +601,53 @@ void Indexer::OutputBinaryIndex(const char* path, const char* tag) {
         return first.first < second.first;
       });
 
-  std::string basename = tag ? std::string("index.") + tag : "index";
+  const std::string basename = IndexBasename(tag);
+
+  // With shared pools, files, strings and snippets are added to the pools,
+  // and offsets in the index refer to the pools rather than to a per-tag file.
+  std::unique_ptr<SharedPool> sharedfiles, sharedstrings, sharedsnippets;
+  google::sparse_hash_map<uint32_t, uint32_t> sharedstringoffsets;
+  google::sparse_hash_map<uint32_t, uint32_t> sharedsnippetoffsets;
+  if (!gl_shared_pool_dir.empty()) {
+    sharedfiles = llvm::make_unique<SharedPool>(
+        JoinPath({gl_shared_pool_dir, "files.pool"}), FileRecordSize);
+    sharedstrings = llvm::make_unique<SharedPool>(
+        JoinPath({gl_shared_pool_dir, "strings.pool"}),
+        SharedPool::StringRecordSize);
+    sharedsnippets = llvm::make_unique<SharedPool>(
+        JoinPath({gl_shared_pool_dir, "snippets.pool"}),
+        SharedPool::StringRecordSize);
+
+    if (!MakeAllDirs(gl_shared_pool_dir, 0777) || !sharedfiles->Open() ||
+        !sharedstrings->Open() || !sharedsnippets->Open()) {
+      std::cerr << "ERROR: could not open shared pools in '"
+                << gl_shared_pool_dir << "', using per tag pools" << std::endl;
+      sharedfiles.reset();
+      sharedstrings.reset();
+      sharedsnippets.reset();
+    }
+  }
+  const bool linkpools = sharedfiles != nullptr;
+
+  const auto& snippetfile = JoinPath({path, basename + ".snippets"});
+  const auto& textfile = JoinPath({path, basename + ".strings"});
+  // Strings interned from multiple threads are laid out in the pool in an
+  // order that depends on scheduling. Repack them in the order the index
+  // refers to them, so the output does not change from run to run.
+  if (!sharedstrings && IndexString::GetPool()->Concurrent())
+    sharedstrings = OpenRepackedPool(textfile);
+  if (!sharedsnippets && SnippetString::GetPool()->Concurrent())
+    sharedsnippets = OpenRepackedPool(snippetfile);
 
   // Output list of files.
   {
     std::ofstream ffile;
     const auto& filesfile = JoinPath({path, basename + ".files"});
-    ffile.open(filesfile, std::ofstream::out | std::ofstream::trunc |
-                              std::ofstream::binary);
+    if (!sharedfiles) {
+      unlink(filesfile.c_str());
+      ffile.open(filesfile, std::ofstream::out | std::ofstream::trunc |
+                                std::ofstream::binary);
+    }
 
     FileOffsetT offset = 0;
     for (auto& fileit : allfiles) {
@@ -443,14 +664,42 @@ void Indexer::OutputBinaryIndex(const char* path, const char* tag) {
       }
 
       FileDetail detail = {fileptr->hash, static_cast<uint16_t>(path.size())};
+      if (sharedfiles) {
+        // Built field by field so padding is zeroed, and identical records
+        // have identical bytes.
+        std::string record(sizeof(detail) + path.size(), '\0');
+        memcpy(&record[offsetof(FileDetail, filehash)], &detail.filehash,
+               sizeof(detail.filehash));
+        memcpy(&record[offsetof(FileDetail, pathsize)], &detail.pathsize,
+               sizeof(detail.pathsize));
+        memcpy(&record[sizeof(detail)], path.data(), path.size());
+        if (!sharedfiles->Add(record.data(), record.size(), &fileoffset))
+          fileoffset = 0;
+        continue;
+      }
+
       ffile.write(reinterpret_cast<const char*>(&detail), sizeof(detail));
       ffile.write(path.data(), path.size());
 
       offset += sizeof(detail) + path.size();
     }
+
+    if (sharedfiles) {
+      sharedfiles->Close();
+      sharedfiles->Link(filesfile);
+    }
+  }
+
+  int fuzzydistance = gl_fuzzy_distance;
+  if (fuzzydistance > 2) {
+    std::cerr << "WARNING: fuzzy index only supports up to 2 edits, "
+              << fuzzydistance << " requested" << std::endl;
+    fuzzydistance = 2;
   }
 
   std::vector<SymbolHashToDetails> hashtodetails;
+  std::vector<SymbolFuzzyToName> fuzzynames;
+  std::vector<SymbolComponentToName> components;
   {
     std::ofstream symfile;
     const auto& symboldetailsfile =
@@ -487,6 +736,8 @@ void Indexer::OutputBinaryIndex(const char* path, const char* tag) {
                                      static_cast<uint16_t>(name.size())};
       symfile.write((const char*)&symdata, sizeof(symdata));
       symfile.write(name.data(), name.size());
+      AddFuzzyVariants(name, symboloff, fuzzydistance, &fuzzynames);
+      AddNameComponents(name, symboloff, &components);
 
       SymbolDetail detdata = {symboloff, symbolhash,
                               static_cast<uint16_t>(symbol.kinds.size())};
@@ -532,26 +783,31 @@ void Indexer::OutputBinaryIndex(const char* path, const char* tag) {
         }
 
         SymbolDetailKind kinddata = {
-            linkkind.kind.GetOffset(), linkkind.linkage, linkkind.access,
-            static_cast<uint16_t>(defsize), static_cast<uint16_t>(declsize)};
+            GetPoolOffset(sharedstrings.get(), &sharedstringoffsets,
+                          linkkind.kind),
+            linkkind.linkage, linkkind.access, static_cast<uint16_t>(defsize),
+            static_cast<uint16_t>(declsize)};
         detfile.write((const char*)&kinddata, sizeof(kinddata));
         detailoff += sizeof(kinddata);
 
-        auto OutputProvider = [&detailoff, &detfile, &allfiles](
+        auto OutputProvider = [&detailoff, &detfile, &allfiles,
+                               &sharedsnippets, &sharedsnippetoffsets](
                                   const Properties::Provider& provider) {
           const auto& fileit = allfiles.find(provider.location.file);
           FileOffsetT foffset = 0;
           if (fileit != allfiles.end()) {
             foffset = fileit->second;
           } else {
-            std::cerr << "ERROR: File " << provider.location.file->path
+            std::cerr << "ERROR: File " << provider.location.file->path.str()
                       << " could not be found in index, leaving 0 offset!\n";
           }
           SymbolDetailProvider towrite;
           towrite.fid = {provider.location.file->hash, foffset};
           towrite.sid = {provider.location.object.sl,
                          provider.location.object.el};
-          towrite.snippet = provider.snippet.GetOffset();
+          towrite.snippet =
+              GetPoolOffset(sharedsnippets.get(), &sharedsnippetoffsets,
+                            provider.snippet);
 
           detfile.write((const char*)&towrite, sizeof(towrite));
           detailoff += sizeof(towrite);
@@ -592,23 +848,81 @@ void Indexer::OutputBinaryIndex(const char* path, const char* tag) {
                    sizeof(SymbolHashToDetails) * hashtodetails.size());
   }
 
+  {
+    std::sort(fuzzynames.begin(), fuzzynames.end(),
+              [](const SymbolFuzzyToName& first,
+                 const SymbolFuzzyToName& second) -> bool {
+                if (first.hash != second.hash) return first.hash < second.hash;
+                return first.nameoffset < second.nameoffset;
+              });
+    // Deleting any character in a run of equal characters gives the same
+    // variant, there is no point in storing it more than once.
+    fuzzynames.erase(std::unique(fuzzynames.begin(), fuzzynames.end(),
+                                 [](const SymbolFuzzyToName& first,
+                                    const SymbolFuzzyToName& second) {
+                                   return first.hash == second.hash &&
+                                          first.nameoffset == second.nameoffset;
+                                 }),
+                     fuzzynames.end());
+
+    std::ofstream fuzzyfile;
+    const auto& fuzzynamesfile = JoinPath({path, basename + ".fuzzy-names"});
+    fuzzyfile.open(fuzzynamesfile, std::ofstream::out | std::ofstream::trunc |
+                                       std::ofstream::binary);
+
+    fuzzyfile.write(reinterpret_cast<const char*>(fuzzynames.data()),
+                    sizeof(SymbolFuzzyToName) * fuzzynames.size());
+  }
+
+  {
+    std::sort(components.begin(), components.end(),
+              [](const SymbolComponentToName& first,
+                 const SymbolComponentToName& second) -> bool {
+                if (first.hash != second.hash) return first.hash < second.hash;
+                if (first.depth != second.depth)
+                  return first.depth < second.depth;
+                return first.nameoffset < second.nameoffset;
+              });
+
+    std::ofstream componentsfile;
+    const auto& componentsname = JoinPath({path, basename + ".components"});
+    componentsfile.open(componentsname, std::ofstream::out |
+                                            std::ofstream::trunc |
+                                            std::ofstream::binary);
+
+    componentsfile.write(reinterpret_cast<const char*>(components.data()),
+                         sizeof(SymbolComponentToName) * components.size());
+  }
+
   // FIXME! TODO!
   const auto& iddetailsfile = JoinPath({path, basename + ".id-details"});
 
   // Now output:
   // - .snippet file, with snippets.
-  const auto& snippetfile = JoinPath({path, basename + ".snippets"});
-  OutputPool(snippetfile.c_str(), *SnippetString::GetPool());
+  if (sharedsnippets) {
+    sharedsnippets->Close();
+    if (linkpools) sharedsnippets->Link(snippetfile);
+  } else {
+    OutputPool(snippetfile.c_str(), SnippetString::GetPool());
+  }
 
   // - .strings file, with all other text.
-  const auto& textfile = JoinPath({path, basename + ".strings"});
-  OutputPool(textfile.c_str(), *IndexString::GetPool());
+  if (sharedstrings) {
+    sharedstrings->Close();
+    if (linkpools) sharedstrings->Link(textfile);
+  } else {
+    OutputPool(textfile.c_str(), IndexString::GetPool());
+  }
 
   // - .json file with integers instead of strings
   // Output this one last as the server uses its timestamp to determine
   // when to re-load the index.
   const auto& jsonfile = JoinPath({path, basename + ".symbols.json"});
   OutputJsonIndex(jsonfile.c_str());
+  if (gl_precompress)
+    PrecompressFile(jsonfile);
+  else
+    RemovePrecompressed(jsonfile);
 }
 
 ObjectId MakeObjectId(const SourceManager& sm, const SourceRange& location) {
@@ -643,14 +957,6 @@ ObjectId MakeObjectId(const SourceManager& sm, const SourceRange& location) {
   return {skey, ekey};
 }
 
-std::string MakeIdName(const ObjectId& objid) {
-  if (objid.sl == 0) return ToHex(objid.el);
-  if (objid.sl == objid.el) return ToHex(objid.el);
-  return (ToHex(objid.sl).operator StringRef() +
-          ToHex(objid.el).operator StringRef())
-      .str();
-}
-
 std::string MakeIdName(const SourceManager& sm, SourceRange location) {
   const auto& objid = MakeObjectId(sm, location);
   return MakeIdName(objid);
@@ -52,27 +52,8 @@ using NameString = UniqString<uint32_t, _kNameString>;
 static_assert(sizeof(NameString) == sizeof(uint32_t),
               "String is using more space than expected");
 
-struct ObjectId {
-  uint64_t sl;
-  uint64_t el;
-
-  bool operator==(const ObjectId& other) const {
-    return sl == other.sl && el == other.el;
-  }
-  bool operator<(const ObjectId& other) const {
-    if (sl == other.sl) return el < other.el;
-    return sl < other.sl;
-  }
-};
 ObjectId MakeObjectId(const SourceManager& sm, const SourceRange& location);
 
-static inline std::ostream& operator<<(std::ostream& stream,
-                                       const ObjectId& objid) {
-  stream << objid.sl;
-  stream << objid.el;
-  return stream;
-}
-
 class Indexer {
  public:
   Indexer(FileCache* cache) : cache_(cache) {}
@@ -165,6 +146,10 @@ class Indexer {
                        const clang::SourceRange& target,
                        const std::string& exception);
 
+  // Backs the snippet and string pools with files in the index directory,
+  // so OutputBinaryIndex only has to rename them. Call before parsing.
+  void MapPoolsToFiles(const char* path, const char* tag);
+
   void OutputJsonIndex(const char* path);
   void OutputBinaryIndex(const char* path, const char* name);
 
@@ -187,7 +172,7 @@ class Indexer {
 
 static inline std::ostream& operator<<(std::ostream& stream,
                                        const Indexer::Id& location) {
-  stream << location.file->path;
+  stream << location.file->path.str();
   const uint64_t el = location.object.el;
 
   stream << ":" << std::to_string((el >> kBeginLineShift) & kLineMask) << ":"
@@ -197,7 +182,6 @@ static inline std::ostream& operator<<(std::ostream& stream,
   return stream;
 }
 
-std::string MakeIdName(const ObjectId& objid);
 std::string MakeIdName(const SourceManager& sm, SourceRange location);
 
 std::string ObjIdToLink(const Indexer::Id& id);
@@ -30,6 +30,7 @@
 #define JSON_HELPERS_H
 
 #include "mempool.h"
+#include "writer.h"
 
 #include <rapidjson/ostreamwrapper.h>
 #include <rapidjson/prettywriter.h>
@@ -106,5 +107,6 @@ void WriteJsonKeyValue(Writer* writer, const char* key, uint64_t value) {
 }
 
 inline void AddJHtmlSeparator(std::ostream* stream) { (*stream) << "\n---\n"; }
+inline void AddJHtmlSeparator(FileWriter* writer) { writer->append("\n---\n"); }
 
 #endif /* JSON_HELPERS_H */
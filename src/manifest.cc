@@ -0,0 +1,164 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#include "manifest.h"
+#include "counters.h"
+#include "writer.h"
+
+#include <fstream>
+#include <sstream>
+
+Counter& c_outputs_unchanged =
+    MakeCounter("output/manifest/unchanged",
+                "Outputs identical to the previous run, left untouched");
+Counter& c_outputs_removed =
+    MakeCounter("output/manifest/removed",
+                "Outputs of the previous run not generated again, removed");
+
+static const char kManifestName[] = "outputs.manifest";
+
+// The manifest stores paths relative to the output directory.
+static std::string RelativeOutputPath(const std::string& path) {
+  const auto& root = GetOutputDir();
+  if (path.size() > root.size() && path.compare(0, root.size(), root) == 0 &&
+      path[root.size()] == '/')
+    return path.substr(root.size() + 1);
+  return path;
+}
+
+bool OutputManifest::Load() {
+  const auto& path = MakeMetaPath(kManifestName);
+  std::ifstream input(path);
+  if (!input) return false;
+
+  // One line per output: the SHA1 in hex, or - if unknown, the size, mtime
+  // and inode of the file, and its path, separated by spaces.
+  std::string line;
+  while (std::getline(input, line)) {
+    std::istringstream fields(line);
+    Entry entry;
+    std::string name;
+    if (!(fields >> entry.hash >> entry.size >> entry.mtime >> entry.inode) ||
+        fields.get() != ' ' || !std::getline(fields, name) || name.empty()) {
+      std::cerr << "WARNING: invalid line in " + path + ": " + line + "\n";
+      continue;
+    }
+    if (entry.hash == "-") entry.hash.clear();
+    previous_.emplace(std::move(name), std::move(entry));
+  }
+
+  return Write(previous_, false);
+}
+
+bool OutputManifest::Stat(const std::string& path, Entry* entry) {
+  struct stat stats;
+  if (stat(path.c_str(), &stats) != 0) return false;
+  entry->size = stats.st_size;
+  entry->mtime = static_cast<uint64_t>(stats.st_mtim.tv_sec) * 1000000000 +
+                 stats.st_mtim.tv_nsec;
+  entry->inode = stats.st_ino;
+  return true;
+}
+
+void OutputManifest::Add(std::string path, Entry entry) {
+  std::unique_lock<std::mutex> guard(lock_);
+  current_[std::move(path)] = std::move(entry);
+}
+
+bool OutputManifest::Unchanged(const std::string& path,
+                               const std::string& hash) {
+  if (hash.empty()) return false;
+  auto relative = RelativeOutputPath(path);
+  const auto found = previous_.find(relative);
+  if (found == previous_.end() || found->second.hash != hash) return false;
+
+  // The file must not have been written since, for example by a run
+  // without --incremental-output.
+  Entry entry;
+  if (!Stat(path, &entry) || entry.size != found->second.size ||
+      entry.mtime != found->second.mtime || entry.inode != found->second.inode)
+    return false;
+
+  Add(std::move(relative), found->second);
+  c_outputs_unchanged.Increment(1);
+  return true;
+}
+
+void OutputManifest::Record(const std::string& path, const std::string& hash) {
+  Entry entry;
+  if (!hash.empty() && Stat(path, &entry)) entry.hash = hash;
+  Add(RelativeOutputPath(path), std::move(entry));
+}
+
+bool OutputManifest::Save() {
+  for (const auto& entry : previous_) {
+    if (current_.count(entry.first)) continue;
+
+    const auto& path = JoinPath({GetOutputDir(), entry.first});
+    if (unlink(path.c_str()) == 0) c_outputs_removed.Increment(1);
+    unlink((path + ".gz").c_str());
+    unlink((path + ".zst").c_str());
+  }
+  previous_.clear();
+
+  return Write(current_, true);
+}
+
+bool OutputManifest::Write(const Entries& entries, bool hashes) {
+  const auto& path = MakeMetaPath(kManifestName);
+  if (!MakeDirs(path, 0777)) {
+    std::cerr << "ERROR: FAILED TO MAKE DIRS FOR MANIFEST '" + path + "'\n";
+    return false;
+  }
+
+  const auto& tmp = path + ".tmp";
+  FileWriter output;
+  if (!output.Open(tmp)) return false;
+  for (const auto& entry : entries) {
+    const auto& fields = entry.second;
+    output.append(hashes && !fields.hash.empty() ? fields.hash : "-");
+    output.append(" " + std::to_string(fields.size) + " " +
+                  std::to_string(fields.mtime) + " " +
+                  std::to_string(fields.inode) + " ");
+    output.append(entry.first);
+    output.Put('\n');
+  }
+  if (!output.Close()) return false;
+
+  if (rename(tmp.c_str(), path.c_str()) < 0) {
+    std::cerr << "ERROR: could not rename " + tmp + " to " + path + ": " +
+                     strerror(errno) + "\n";
+    return false;
+  }
+  return true;
+}
+
+OutputManifest& GlobalOutputManifest() {
+  static auto* manifest = new OutputManifest();
+  return *manifest;
+}
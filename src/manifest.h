@@ -0,0 +1,87 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "base.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Remembers the SHA1 of each file generated in the output directory, in a
+// manifest saved in the meta directory, together with the size, mtime and
+// inode the file had once written. With it, a run can leave the files
+// identical to the previous run untouched, and remove the files the previous
+// run generated but this one did not.
+class OutputManifest {
+ public:
+  // Loads the manifest of the previous run, if any. Until Save() is called,
+  // the manifest left on disk only lists paths, without hashes: if the run
+  // is interrupted, files may have changed without the manifest knowing.
+  bool Load();
+
+  // Returns true if path had content hash in the previous run, and is still
+  // the same file, not rewritten since. It is then recorded as generated by
+  // this run, and does not need to be written again. Thread safe.
+  bool Unchanged(const std::string& path, const std::string& hash);
+  // Records path as generated by this run, once it is in place with content
+  // hash. With an empty hash, the file is kept, but never considered
+  // unchanged. Thread safe.
+  void Record(const std::string& path, const std::string& hash);
+  void Record(const std::string& path) { Record(path, std::string()); }
+
+  // Removes the files of the previous run that were not recorded by this
+  // one, together with their compressed copies, and saves the manifest.
+  bool Save();
+
+ private:
+  struct Entry {
+    // Empty if unknown.
+    std::string hash;
+    // Of the file as last written, to detect any other write.
+    uint64_t size = 0;
+    uint64_t mtime = 0;  // In nanoseconds.
+    uint64_t inode = 0;
+  };
+  using Entries = std::unordered_map<std::string, Entry>;
+
+  // Sets size, mtime and inode of entry from the file at path.
+  static bool Stat(const std::string& path, Entry* entry);
+  static bool Write(const Entries& entries, bool hashes);
+  void Add(std::string path, Entry entry);
+
+  Entries previous_;
+  std::mutex lock_;
+  Entries current_;
+};
+
+OutputManifest& GlobalOutputManifest();
+
+#endif /* MANIFEST_H */
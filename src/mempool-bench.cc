@@ -0,0 +1,173 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+// Benchmark of the string interning in mempool.h.
+//
+// Reads the files passed on the command line, and interns every identifier
+// and every line in them, first the way UniqString used to (byte at a time
+// FNV-1a, a google::sparse_hash_set of strings in the pool, allocating each
+// string before looking it up), then with UniqString. Hashing alone is timed
+// too. Run with "make bench".
+
+#include "mempool.h"
+
+#include <sparsehash/sparse_hash_set>
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+const char kBenchOld[] = "bench-old";
+const char kBenchNew[] = "bench-new";
+
+using OldString = ConstString<uint32_t, kBenchOld>;
+using NewString = UniqString<uint32_t, kBenchNew>;
+
+// The hasher UniqString used before HashBytes.
+static inline size_t HashFnv(const char* ptr, size_t size) {
+  const char* end = ptr + size;
+  size_t hash = 0xcbf29ce484222325;
+  for (; ptr < end; ++ptr) {
+    hash = hash * 0x100000001b3;
+    hash = hash ^ *ptr;
+  }
+  return hash;
+}
+
+struct OldHasher {
+  size_t operator()(const OldString& str) const {
+    return HashFnv(str.data(), str.size());
+  }
+};
+using OldDeduper = google::sparse_hash_set<OldString, OldHasher>;
+
+static void InternOld(OldDeduper* deduper, StringRef input) {
+  OldString str(input.data(), input.size());
+  if (!deduper->insert(str).second) str.Drop();
+}
+
+// Keeps the hashes computed by Run from being optimized away.
+static volatile size_t g_sink;
+
+// Runs function rounds times, returns the fastest run in milliseconds.
+template <typename FunctionT>
+static double Time(int rounds, FunctionT function) {
+  double best = 0;
+  for (int round = 0; round < rounds; ++round) {
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (!round || elapsed.count() < best) best = elapsed.count();
+  }
+  return best;
+}
+
+static void Run(const char* name, const std::vector<StringRef>& inputs) {
+  constexpr int kRounds = 5;
+  uint64_t bytes = 0;
+  for (const auto& input : inputs) bytes += input.size();
+
+  size_t sink = 0;
+  const double fnv = Time(kRounds, [&]() {
+    for (const auto& input : inputs)
+      sink += HashFnv(input.data(), input.size());
+  });
+  const double hashbytes = Time(kRounds, [&]() {
+    for (const auto& input : inputs)
+      sink += HashBytes(input.data(), input.size());
+  });
+
+  size_t unique = 0;
+  const double old = Time(kRounds, [&]() {
+    OldDeduper deduper;
+    for (const auto& input : inputs) InternOld(&deduper, input);
+    unique = deduper.size();
+    OldString::GetPool()->Clear();
+  });
+  const double uniq = Time(kRounds, [&]() {
+    NewString::Clear();
+    for (const auto& input : inputs) NewString str(input);
+  });
+
+  std::cout << name << ": " << inputs.size() << " (" << unique
+            << " unique), " << GetHumanValue(bytes) << "\n"
+            << "  hash, fnv-1a:          " << fnv << " ms\n"
+            << "  hash, HashBytes:       " << hashbytes << " ms\n"
+            << "  intern, fnv + sparse:  " << old << " ms\n"
+            << "  intern, UniqString:    " << uniq << " ms" << std::endl;
+  g_sink = sink;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " FILE..." << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> contents;
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream input(argv[i]);
+    if (!input) {
+      std::cerr << "WARNING: could not read " << argv[i] << std::endl;
+      continue;
+    }
+    std::ostringstream buffer;
+    buffer << input.rdbuf();
+    contents.emplace_back(buffer.str());
+  }
+
+  std::vector<StringRef> identifiers;
+  std::vector<StringRef> lines;
+  for (const auto& content : contents) {
+    const char* data = content.data();
+    const size_t size = content.size();
+    size_t line = 0;
+    for (size_t i = 0; i < size;) {
+      if (data[i] == '\n') {
+        lines.emplace_back(data + line, i - line);
+        line = ++i;
+        continue;
+      }
+      if (!isalpha(static_cast<unsigned char>(data[i])) && data[i] != '_') {
+        ++i;
+        continue;
+      }
+      const size_t start = i;
+      while (i < size &&
+             (isalnum(static_cast<unsigned char>(data[i])) || data[i] == '_'))
+        ++i;
+      identifiers.emplace_back(data + start, i - start);
+    }
+    if (line < size) lines.emplace_back(data + line, size - line);
+  }
+
+  Run("identifiers", identifiers);
+  Run("lines", lines);
+  return 0;
+}
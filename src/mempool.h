@@ -32,10 +32,18 @@
 #include "base.h"
 #include "common.h"
 
-#include <sparsehash/sparse_hash_set>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+
 class MemoryPrinter {
  public:
   MemoryPrinter(const std::string& name, std::function<void()> function) {
@@ -91,43 +99,304 @@ class StlCapacityPrinter : public MemoryPrinter {
   }
 };
 
-template <typename ObjectT, typename OffsetT>
+// Allocates memory in fixed size chunks, so that growing the pool never moves
+// or copies the data already stored, and pointers returned by Get() stay valid
+// until Clear() is called.
+//
+// Offsets are encoded as (chunk << kChunkShift) | offset in chunk. Allocations
+// never straddle two chunks: if there is not enough space left in the current
+// chunk, the space is left unused and the allocation starts at the next one.
+// Allocations larger than a chunk get a single contiguous block spanning as
+// many chunk slots as necessary.
+//
+// Allocate(), Return() and Get() can be called from multiple threads. Each
+// thread allocates from its own chunk, and only takes a lock to get a new
+// one. Clear() and Dump() must not run concurrently with anything else.
+//
+// OffsetT can be a uint64_t for pools that need to grow past 4GB.
+template <typename ObjectT, typename OffsetT, int kChunkShift = 20>
 class MemPool {
  public:
+  static_assert(std::is_unsigned<OffsetT>::value,
+                "MemPool offsets must be unsigned");
+  static_assert(kChunkShift < sizeof(OffsetT) * 8,
+                "MemPool chunks cannot be larger than the offset space");
+
+  static constexpr uint64_t kChunkSize = 1ULL << kChunkShift;
+  static constexpr uint64_t kChunkMask = kChunkSize - 1;
+  // Size of the chunk directory. It never grows, so Get() can read it
+  // while other threads are allocating.
+  static constexpr uint64_t kMaxChunks =
+      sizeof(OffsetT) * 8 - kChunkShift > 16
+          ? 1ULL << 16
+          : 1ULL << (sizeof(OffsetT) * 8 - kChunkShift);
+
   MemPool(const char* name)
-      : printer_(std::string(name) + ":mempool", [this]() {
-          StlCapacityPrinter<decltype(memory_)>::Print(&memory_);
-          std::cerr << " entries " << GetSuffixedValueIS(elements_) << " ("
-                    << elements_ << ")";
+      : name_(name),
+        chunks_(new std::atomic<ObjectT*>[kMaxChunks]()),
+        id_(NextId()),
+        generation_(NextId()),
+        printer_(std::string(name) + ":mempool", [this]() {
+          uint64_t elements = 0;
+          for (const auto& cursor : cursors_) elements += cursor.elements;
+          std::cerr << "size " << GetSuffixedValueBytes(Size()) << " ("
+                    << Size() << ") capacity "
+                    << GetSuffixedValueBytes(Capacity()) << " (" << Capacity()
+                    << ") padding " << GetSuffixedValueBytes(padding_) << " ("
+                    << padding_ << ") threads " << cursors_.size()
+                    << " entries " << GetSuffixedValueIS(elements) << " ("
+                    << elements << ")";
         }) {}
 
   OffsetT Allocate(OffsetT size) {
-    ++elements_;
-    OffsetT retval = memory_.size();
-    memory_.resize(size + memory_.size());
+    Cursor* cursor = GetCursor();
+    if (size > cursor->end - cursor->used) NewChunk(cursor, size);
+
+    ++cursor->elements;
+    OffsetT retval = cursor->used;
+    cursor->used += size;
     return retval;
   }
 
-  ObjectT* Get(OffsetT offset) { return &memory_[offset]; }
+  ObjectT* Get(OffsetT offset) const {
+    return chunks_[offset >> kChunkShift].load(std::memory_order_acquire) +
+           (offset & kChunkMask);
+  }
 
   bool Return(OffsetT offset, OffsetT size) {
-    if (offset + size == memory_.size()) {
-      memory_.resize(offset);
+    Cursor* cursor = GetCursor();
+    if (offset + size == cursor->used) {
+      cursor->used = offset;
       return true;
     }
     return false;
   }
 
+  ~MemPool() { Unmap(); }
+
   void Clear() {
-    std::vector<ObjectT>().swap(memory_);
-    elements_ = 0;
+    Unmap();
+    for (uint64_t i = 0; i < (end_ >> kChunkShift); ++i) chunks_[i] = nullptr;
+    std::vector<std::unique_ptr<ObjectT[]>>().swap(blocks_);
+    std::deque<Cursor>().swap(cursors_);
+    end_ = padding_ = 0;
+    generation_ = NextId();
+  }
+
+  // Allocates all further chunks in a file mapped in memory, so the kernel
+  // can page out the data, and Finalize() can turn the file into the final
+  // output without writing it again. The file is created next to path, and
+  // removed by Clear() if the pool is not finalized. Must be called before
+  // the first allocation.
+  bool MapToFile(const std::string& path) {
+    if (end_ || fd_ >= 0) {
+      std::cerr << "ERROR: mempool " << name_
+                << " can only be mapped to a file while empty" << std::endl;
+      return false;
+    }
+
+    file_ = path + ".tmp";
+    fd_ = open(file_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      std::cerr << "ERROR: could not create " << file_ << " for mempool "
+                << name_ << ": " << strerror(errno) << std::endl;
+      file_.clear();
+      return false;
+    }
+    mapped_all_ = true;
+    return true;
+  }
+
+  // Trims the file backing the pool to the size of the data and renames it
+  // to path. Returns false if the pool is not entirely backed by a file, in
+  // which case the caller should Dump() it. Nothing can be allocated from
+  // the pool afterwards.
+  bool Finalize(const std::string& path) {
+    if (fd_ < 0 || !mapped_all_) return false;
+
+    if (ftruncate(fd_, Size()) < 0) {
+      std::cerr << "ERROR: could not truncate " << file_ << ": "
+                << strerror(errno) << std::endl;
+      return false;
+    }
+    // Start writeback now, rather than leave it all to munmap.
+    for (const auto& mapping : mappings_)
+      msync(mapping.first, mapping.second, MS_ASYNC);
+
+    if (rename(file_.c_str(), path.c_str()) < 0) {
+      std::cerr << "ERROR: could not rename " << file_ << " to " << path
+                << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    file_.clear();
+    return true;
   }
 
-  std::vector<ObjectT> GetStorage() const { return memory_; }
+  // True if more than one thread allocated from this pool since the last
+  // Clear(). The position of each string then depends on thread scheduling.
+  bool Concurrent() const { return cursors_.size() > 1; }
+
+  // Number of bytes that Dump() will write, including padding.
+  uint64_t Size() const {
+    // Only the thread that allocated the last chunk knows how much of it
+    // is in use.
+    for (const auto& cursor : cursors_)
+      if (cursor.end == end_) return cursor.used * sizeof(ObjectT);
+    return end_ * sizeof(ObjectT);
+  }
+
+  // Writes the content of the pool to the file descriptor, one chunk at a
+  // time, without copying it. The data written at position N is the object
+  // at offset N, unused space at the end of chunks is written as is.
+  bool Dump(int fd) const {
+    const uint64_t total = Size() / sizeof(ObjectT);
+    for (uint64_t offset = 0; offset < total;) {
+      uint64_t size = total - offset;
+      if (size > kChunkSize) size = kChunkSize;
+
+      const char* data = reinterpret_cast<const char*>(Get(offset));
+      size_t left = size * sizeof(ObjectT);
+      while (left > 0) {
+        auto written = write(fd, data, left);
+        if (written < 0) {
+          if (errno == EINTR) continue;
+          std::cerr << "ERROR: could not dump mempool " << name_ << ": "
+                    << strerror(errno) << std::endl;
+          return false;
+        }
+        data += written;
+        left -= written;
+      }
+      offset += size;
+    }
+    return true;
+  }
 
  private:
-  std::vector<ObjectT> memory_;
-  OffsetT elements_ = 0;
+  // Allocation state of one thread.
+  struct Cursor {
+    // First free offset, and offset of the end of the chunk in use.
+    uint64_t used = 0;
+    uint64_t end = 0;
+    uint64_t elements = 0;
+  };
+
+  static uint64_t NextId() {
+    static std::atomic<uint64_t> id{0};
+    return id++;
+  }
+
+  Cursor* GetCursor() {
+    struct ThreadCursor {
+      uint64_t generation;
+      Cursor* cursor;
+    };
+    // Indexed by pool id, shared by all the pools of the same type.
+    static thread_local std::vector<ThreadCursor> cursors;
+
+    if (cursors.size() <= id_) cursors.resize(id_ + 1, {~0ULL, nullptr});
+    auto& local = cursors[id_];
+    if (local.generation != generation_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cursors_.emplace_back();
+      local = {generation_, &cursors_.back()};
+    }
+    return local.cursor;
+  }
+
+  void NewChunk(Cursor* cursor, uint64_t size) {
+    uint64_t chunks = (size + kChunkMask) >> kChunkShift;
+    if (!chunks) chunks = 1;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((end_ >> kChunkShift) + chunks > kMaxChunks ||
+        end_ + (chunks << kChunkShift) - 1 >
+            std::numeric_limits<OffsetT>::max()) {
+      std::cerr << "FATAL: mempool " << name_ << " is out of offset space, "
+                << "cannot allocate " << size << " bytes after " << end_
+                << std::endl;
+      abort();
+    }
+
+    ObjectT* block = fd_ >= 0 ? MapChunks(chunks) : nullptr;
+    if (!block) {
+      blocks_.emplace_back(new ObjectT[chunks << kChunkShift]());
+      block = blocks_.back().get();
+    }
+    for (uint64_t i = 0; i < chunks; ++i) {
+      chunks_[(end_ >> kChunkShift) + i].store(block + (i << kChunkShift),
+                                               std::memory_order_release);
+    }
+
+    padding_ += cursor->end - cursor->used;
+    cursor->used = end_;
+    end_ += chunks << kChunkShift;
+    cursor->end = end_;
+  }
+
+  // Extends the file backing the pool, and maps the new chunks in memory.
+  // Each chunk is mapped separately, so existing chunks never move. Returns
+  // nullptr on failure, the pool then falls back to memory allocations.
+  ObjectT* MapChunks(uint64_t chunks) {
+    const size_t offset = end_ * sizeof(ObjectT);
+    const size_t size = (chunks << kChunkShift) * sizeof(ObjectT);
+
+    void* mapped = MAP_FAILED;
+    if (ftruncate(fd_, offset + size) >= 0)
+      mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+                    offset);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "WARNING: could not map " << file_ << " for mempool "
+                << name_ << ", keeping it in memory: " << strerror(errno)
+                << std::endl;
+      mapped_all_ = false;
+      return nullptr;
+    }
+
+    mappings_.emplace_back(mapped, size);
+    return static_cast<ObjectT*>(mapped);
+  }
+
+  void Unmap() {
+    for (const auto& mapping : mappings_) munmap(mapping.first, mapping.second);
+    std::vector<std::pair<void*, size_t>>().swap(mappings_);
+
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+    if (!file_.empty()) unlink(file_.c_str());
+    file_.clear();
+  }
+
+  uint64_t Capacity() const { return end_ * sizeof(ObjectT); }
+
+  const char* name_;
+
+  // One pointer per chunk slot, an allocation spanning multiple chunks has
+  // multiple consecutive slots pointing in the same block.
+  std::unique_ptr<std::atomic<ObjectT*>[]> chunks_;
+
+  // Everything below is protected by mutex_.
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ObjectT[]>> blocks_;
+  // One per thread that allocated from the pool, a deque so pointers to
+  // the elements remain valid.
+  std::deque<Cursor> cursors_;
+
+  // File backing the pool, set by MapToFile(), and its mappings.
+  int fd_ = -1;
+  std::string file_;
+  bool mapped_all_ = false;
+  std::vector<std::pair<void*, size_t>> mappings_;
+
+  // Offset of the end of the last chunk.
+  uint64_t end_ = 0;
+  // Bytes left unused at the end of chunks.
+  uint64_t padding_ = 0;
+
+  // Identifies the pool in the per thread cursors, and tells apart the
+  // cursors created before the last Clear().
+  const uint64_t id_;
+  uint64_t generation_;
 
   MemoryPrinter printer_;
 };
@@ -228,19 +497,50 @@ bool operator!=(const std::string& first,
          memcmp(first.data(), second.data(), first.size());
 }
 
+// Hashes 8 bytes at a time. Hashes are only used in memory, they are never
+// stored in the index, so the result does not need to be portable.
+static inline uint64_t HashBytes(const char* data, size_t size) {
+  constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+
+  uint64_t hash = size * kMultiplier;
+  uint64_t word;
+  for (const char* end = data + (size & ~7); data < end; data += 8) {
+    memcpy(&word, data, sizeof(word));
+    hash = (hash ^ word) * kMultiplier;
+    hash = (hash << 31) | (hash >> 33);
+  }
+  const size_t tail = size & 7;
+  if (tail) {
+    if (size >= 8) {
+      // Re-read the last 8 bytes, overlapping with the previous word.
+      memcpy(&word, data + tail - 8, sizeof(word));
+    } else if (tail >= 4) {
+      uint32_t first, last;
+      memcpy(&first, data, sizeof(first));
+      memcpy(&last, data + tail - 4, sizeof(last));
+      word = static_cast<uint64_t>(first) << 32 | last;
+    } else {
+      word = static_cast<uint64_t>(static_cast<uint8_t>(data[0])) << 16 |
+             static_cast<uint64_t>(static_cast<uint8_t>(data[tail >> 1])) << 8 |
+             static_cast<uint8_t>(data[tail - 1]);
+    }
+    hash = (hash ^ word) * kMultiplier;
+  }
+
+  // Final mix from murmur3, so all the bits depend on all the input.
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
 template <typename Derived, typename OffsetT, const char* Instance>
 struct ConstStringBaseHasher {
   std::size_t operator()(
       const ConstStringBase<Derived, OffsetT, Instance>& base) const {
-    const char* ptr = base.data();
-    const char* end = base.data() + base.size();
-
-    size_t hash = 0xcbf29ce484222325;
-    for (; ptr < end; ++ptr) {
-      hash = hash * 0x100000001b3;
-      hash = hash ^ *ptr;
-    }
-    return hash;
+    return HashBytes(base.data(), base.size());
   }
 };
 
@@ -265,26 +565,109 @@ template <typename OffsetT, const char* Instance>
 typename ConstString<OffsetT, Instance>::Pool
     ConstString<OffsetT, Instance>::pool_(Instance);
 
+// Maps strings to their offset in the pool.
+//
+// The strings are split in kShards open addressing tables with linear
+// probing, each protected by its own lock, so threads interning different
+// strings rarely wait on each other. Next to the offset, each slot keeps 32
+// bits of the hash of the string, so probes only read the pool when the
+// fingerprints match, and a table can be grown without reading the strings
+// again.
 template <typename Base, typename OffsetT, const char* Instance>
 struct Deduper {
   Deduper() {}
 
-  using Map =
-      google::sparse_hash_set<Base,
-                              ConstStringBaseHasher<Base, OffsetT, Instance>>;
-  Map table;
+  static constexpr int kShardBits = 6;
+  static constexpr uint64_t kShards = 1 << kShardBits;
+
+  struct Slot {
+    // 0 means that the slot is empty.
+    uint32_t fingerprint;
+    OffsetT offset;
+  };
+
+  struct Shard {
+    // Returns the slot holding the string, or the empty slot where the
+    // string should be stored. fingerprint is set to the value to store in
+    // the slot. Must be called with mutex held.
+    Slot* Find(const char* data, OffsetT size, uint64_t hash,
+               uint32_t* fingerprint) {
+      if ((entries + 1) * 4 > slots.size() * 3) Grow();
+
+      *fingerprint = hash >> 32;
+      if (!*fingerprint) *fingerprint = 1;
+
+      const size_t mask = slots.size() - 1;
+      for (size_t pos = Position(*fingerprint);; pos = (pos + 1) & mask) {
+        Slot* slot = &slots[pos];
+        if (!slot->fingerprint) return slot;
+        if (slot->fingerprint != *fingerprint) continue;
+
+        const char* stored = Base::GetPool()->Get(slot->offset);
+        OffsetT stored_size;
+        memcpy(&stored_size, stored, sizeof(OffsetT));
+        if (stored_size == size &&
+            !memcmp(stored + sizeof(OffsetT), data, size))
+          return slot;
+      }
+    }
+
+    size_t Position(uint32_t fingerprint) const {
+      return (fingerprint * 0x9e3779b97f4a7c15ULL) >> shift;
+    }
+
+    void Grow() {
+      shift = slots.empty() ? 64 - 8 : shift - 1;
+      std::vector<Slot> old(1ULL << (64 - shift), Slot{0, 0});
+      old.swap(slots);
+
+      const size_t mask = slots.size() - 1;
+      for (const auto& slot : old) {
+        if (!slot.fingerprint) continue;
+        size_t pos = Position(slot.fingerprint);
+        while (slots[pos].fingerprint) pos = (pos + 1) & mask;
+        slots[pos] = slot;
+      }
+    }
+
+    std::mutex mutex;
+    std::vector<Slot> slots;
+    // 64 - log2(slots.size()), the hash bits to drop to compute a position.
+    int shift = 64;
+
+    uint64_t entries = 0;
+    uint64_t saved_bytes = 0;
+    uint64_t saved_strings = 0;
+  };
+
+  // Low bits pick the shard, high bits are used for the fingerprint.
+  Shard& GetShard(uint64_t hash) { return shards[hash & (kShards - 1)]; }
 
   void Clear() {
-    saved_bytes = 0;
-    saved_strings = 0;
-    table.clear();
+    for (auto& shard : shards) {
+      shard.entries = 0;
+      shard.saved_bytes = 0;
+      shard.saved_strings = 0;
+      shard.shift = 64;
+      std::vector<Slot>().swap(shard.slots);
+    }
   }
 
-  uint64_t saved_bytes = 0;
-  uint64_t saved_strings = 0;
+  Shard shards[kShards];
+
   MemoryPrinter printer{std::string(Instance) + ":deduper", [this]() {
-                          StlSizePrinter<Map>::Print(&table);
-                          std::cerr << "savings "
+                          uint64_t entries = 0, slots = 0;
+                          uint64_t saved_bytes = 0, saved_strings = 0;
+                          for (const auto& shard : shards) {
+                            entries += shard.entries;
+                            slots += shard.slots.size();
+                            saved_bytes += shard.saved_bytes;
+                            saved_strings += shard.saved_strings;
+                          }
+                          std::cerr << "size " << GetSuffixedValueIS(entries)
+                                    << " (" << entries << ") slots "
+                                    << GetSuffixedValueIS(slots) << " ("
+                                    << slots << ") savings "
                                     << GetSuffixedValueBytes(saved_bytes)
                                     << " (" << saved_bytes << ") entries "
                                     << GetSuffixedValueIS(saved_strings) << " ("
@@ -314,17 +697,23 @@ class UniqString
   friend Base;
 
   void Create(const char* data, OffsetT size) {
-    String str(data, size);
-
-    auto result = deduper_.table.insert(str);
-    if (result.second) {
+    const uint64_t hash = HashBytes(data, size);
+    auto& shard = deduper_.GetShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    uint32_t fingerprint;
+    auto* slot = shard.Find(data, size, hash, &fingerprint);
+    if (!slot->fingerprint) {
+      String str(data, size);
+
+      slot->fingerprint = fingerprint;
+      slot->offset = str.GetOffset();
+      shard.entries += 1;
       this->offset_ = str.GetOffset();
     } else {
-      str.Drop();
-
-      deduper_.saved_bytes += size;
-      deduper_.saved_strings += 1;
-      this->offset_ = result.first->GetOffset();
+      shard.saved_bytes += size;
+      shard.saved_strings += 1;
+      this->offset_ = slot->offset;
     }
   }
 
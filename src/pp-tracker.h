@@ -118,13 +118,12 @@ class PPTracker : public PPCallbacks {
                           StringRef SearchPath, StringRef RelativePath,
                           const clang::Module* Imported,
                           SrcMgr::CharacteristicKind FileType) override {
-    auto included_full_path = (SearchPath + "/" + RelativePath).str();
     auto* file_descriptor =
-        recorder_->GetCache()->GetFileFor(included_full_path);
+        File ? recorder_->GetCache()->GetFileFor(*File) : nullptr;
 
     if (gl_verbose)
-      std::cerr << "#INCLUDING " << file_descriptor->path << " ("
-                << included_full_path << ") FROM "
+      std::cerr << "#INCLUDING " << GetFilePath(file_descriptor) << " ("
+                << (SearchPath + "/" + RelativePath).str() << ") FROM "
                 << recorder_->PrintLocation(loc) << " ("
                 << GetFilePath(recorder_->GetFileFor(filename_range.getBegin()))
                 << ") P:" << ShouldProcess()
@@ -132,14 +131,13 @@ class PPTracker : public PPCallbacks {
 
     if (!File) {
       c_pp_file_failed_inclusion.Add(filename_range.getAsRange())
-          << included_full_path;
+          << (SearchPath + "/" + RelativePath).str();
       return;
     }
 
-    auto html_path = file_descriptor->HtmlPath();
     WrapWithTag(*recorder_->GetCI(), recorder_->GetCache(),
                 filename_range.getAsRange(),
-                std::move(MakeTag("a", {"include"}, {"href", html_path})));
+                MakeIncludeTag(file_descriptor->hash));
   }
 
   void MacroExpands(const Token& name, const MacroDefinition& md,
@@ -219,7 +217,7 @@ class PPTracker : public PPCallbacks {
     auto& state = if_stack_.top();
     if (state.condition == CVK_False) {
       WrapEolSol(*recorder_->GetCI(), recorder_->GetCache(), state.if_start,
-                 location, MakeTag("span", {"preprocessor-if", "muted"}, {}));
+                 location, MakeSpanTag("preprocessor-if muted"));
     }
     state.condition = value;
     state.if_start = cond_range.getBegin();
@@ -240,7 +238,7 @@ class PPTracker : public PPCallbacks {
       recorder_->CodeUses(mrange, "MACRO", "MACRO", target);
     } else {
       WrapWithTag(*recorder_->GetCI(), recorder_->GetCache(), mrange,
-                  std::move(MakeTag("span", {"macro-undefined"}, {})));
+                  MakeSpanTag("macro-undefined"));
     }
   }
 
@@ -260,7 +258,7 @@ class PPTracker : public PPCallbacks {
       recorder_->CodeUses(mrange, "MACRO", "MACRO", target);
     } else {
       WrapWithTag(*recorder_->GetCI(), recorder_->GetCache(), mrange,
-                  std::move(MakeTag("span", {"macro-undefined"}, {})));
+                  MakeSpanTag("macro-undefined"));
     }
 
     if_stack_.emplace((definition ? CVK_True : CVK_False), name.getEndLoc());
@@ -281,7 +279,7 @@ class PPTracker : public PPCallbacks {
       recorder_->CodeUses(mrange, "MACRO", "MACRO", target);
     } else {
       WrapWithTag(*recorder_->GetCI(), recorder_->GetCache(), mrange,
-                  std::move(MakeTag("span", {"macro-undefined"}, {})));
+                  MakeSpanTag("macro-undefined"));
     }
 
     if_stack_.emplace((definition ? CVK_False : CVK_True), name.getEndLoc());
@@ -298,7 +296,7 @@ class PPTracker : public PPCallbacks {
     auto& state = if_stack_.top();
     if (state.condition == CVK_False) {
       WrapEolSol(*recorder_->GetCI(), recorder_->GetCache(), state.if_start,
-                 location, MakeTag("span", {"preprocessor-if", "muted"}, {}));
+                 location, MakeSpanTag("preprocessor-if muted"));
       state.condition = CVK_True;
     } else {
       state.condition = CVK_False;
@@ -317,7 +315,7 @@ class PPTracker : public PPCallbacks {
     const auto& state = if_stack_.top();
     if (state.condition == CVK_False) {
       WrapEolSol(*recorder_->GetCI(), recorder_->GetCache(), state.if_start,
-                 location, MakeTag("span", {"preprocessor-if", "muted"}, {}));
+                 location, MakeSpanTag("preprocessor-if muted"));
     }
     if_stack_.pop();
   };
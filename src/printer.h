@@ -161,7 +161,7 @@ static inline std::string PrintSpellingLocation(const SourceManager& sm,
   auto sf = cache->GetSpellingFileFor(sm, location.getBegin());
   auto ef = cache->GetSpellingFileFor(sm, location.getEnd());
 
-  std::string output(sf->path);
+  std::string output(sf->path.str());
   raw_string_ostream s(output);
 
   PrintSpellingLineNumbers(s, sm, location.getBegin());
@@ -27,8 +27,23 @@
 // policies, either expressed or implied, of Carlo Contavalli.
 
 #include "renderer.h"
+#include "cindex.h"
+#include "counters.h"
+#include "escaping.h"
 #include "json-helpers.h"
+#include "manifest.h"
+#include "utf8.h"
 #include "wrapping.h"
+#include "writer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 // DEPRECATE once we remove the template expansion logic.
 cl::opt<std::string> gl_project_name(
@@ -48,6 +63,75 @@ cl::opt<std::string> gl_scan_filter_regex(
 cl::opt<std::string> gl_tag(
     "t", cl::desc("Tag to use when querying the symbols / tree database."),
     cl::value_desc("tag"), cl::init("output"), cl::cat(gl_category));
+cl::opt<bool> gl_line_index(
+    "line-index", cl::init(true),
+    cl::desc("Output a .jlines file with the offset of each line in the html "
+             "of parsed sources, so any line range can be served by seeking."),
+    cl::cat(gl_category));
+cl::opt<unsigned> gl_page_lines(
+    "page-lines", cl::init(0),
+    cl::desc("If not 0, close and reopen all the tags in the html of parsed "
+             "sources every this many lines, so each page is valid html."),
+    cl::value_desc("lines"), cl::cat(gl_category));
+cl::opt<unsigned> gl_output_jobs(
+    "output-jobs", cl::init(0),
+    cl::desc("Number of threads writing out files and directories, 0 to use "
+             "one per core."),
+    cl::value_desc("threads"), cl::cat(gl_category));
+cl::opt<unsigned> gl_scan_jobs(
+    "scan-jobs", cl::init(0),
+    cl::desc("Number of threads scanning and reading the tree passed with "
+             "--scandir, 0 to use one per core."),
+    cl::value_desc("threads"), cl::cat(gl_category));
+cl::opt<bool> gl_link_files(
+    "link-files", cl::init(true),
+    cl::desc("Hard link media files (and blobs, with --output-blobs) from the "
+             "source tree into the output, instead of copying them. Copies "
+             "are made with reflinks or in kernel when possible."),
+    cl::cat(gl_category));
+cl::opt<bool> gl_output_blobs(
+    "output-blobs", cl::init(false),
+    cl::desc("Also place the original of binary files in the output, linked "
+             "from their page."),
+    cl::cat(gl_category));
+cl::opt<bool> gl_annotations(
+    "annotations", cl::init(false),
+    cl::desc("Instead of html, output parsed sources as is in a .jsrc file, "
+             "with the tags in a binary .jann file, to be applied by the "
+             "server. See cindex.h for the format."),
+    cl::cat(gl_category));
+cl::opt<std::string> gl_objects_dir(
+    "objects-dir",
+    cl::desc("If set, store each generated output file once in this "
+             "directory, named by the SHA1 of its content, and hard link it "
+             "in the output. The directory can be shared by different tags, "
+             "and must be on the same filesystem as the output."),
+    cl::value_desc("path"), cl::cat(gl_category));
+cl::opt<bool> gl_precompress(
+    "precompress", cl::init(false),
+    cl::desc("Next to the .jhtml files and the json indexes, also write "
+             "copies compressed with gzip (.gz) and, if supported, zstd "
+             "(.zst), for the server to send as is."),
+    cl::cat(gl_category));
+cl::opt<int> gl_precompress_level(
+    "precompress-level", cl::init(6),
+    cl::desc("zstd compression level of the copies written by --precompress, "
+             "from 1 to 22. Higher levels are much slower, and slow down the "
+             "output threads."),
+    cl::value_desc("level"), cl::cat(gl_category));
+cl::opt<bool> gl_incremental_output(
+    "incremental-output", cl::init(false),
+    cl::desc("Compare the generated files with the previous run, using the "
+             "hashes in meta/outputs.manifest: files with the same content "
+             "are not rewritten, and files no longer generated are removed."),
+    cl::cat(gl_category));
+
+Counter& c_objects_deduplicated =
+    MakeCounter("output/objects/deduplicated",
+                "Outputs identical to an object already in --objects-dir");
+Counter& c_objects_bytes_saved =
+    MakeCounter("output/objects/bytes-saved",
+                "Bytes not stored thanks to deduplicated outputs");
 
 std::pair<std::string, std::string> SplitPath(const std::string& name) {
   auto slash = name.rfind('/');
@@ -68,7 +152,7 @@ StringRef FileRenderer::GetUserPath(const StringRef& path) const {
 }
 
 #define STRANDLEN(str) str, sizeof(str)
-FileRenderer::FileType GetFileTypeByExtension(const std::string& name,
+FileRenderer::FileType GetFileTypeByExtension(StringRef name,
                                               const char** extension) {
   static constexpr const struct {
     const char* extension;
@@ -105,7 +189,7 @@ FileRenderer::FileType GetFileTypeByExtension(const std::string& name,
                     {STRANDLEN(".mpeg"), FileRenderer::kFileMedia},
                     {STRANDLEN(".3gp"), FileRenderer::kFileMedia}};
   char buffer[] = "      ";
-  const auto length = name.length();
+  const auto length = name.size();
   if (length < 5) return FileRenderer::kFileUnknown;
 
   // Find the '.' for the extension.
@@ -124,198 +208,222 @@ FileRenderer::FileType GetFileTypeByExtension(const std::string& name,
   return FileRenderer::kFileUnknown;
 }
 
-FileRenderer::FileType GetFileType(const std::string& name,
-                                   const std::string& content,
-                                   const char** extension) {
-  auto type = GetFileTypeByExtension(name, extension);
-  if (type != FileRenderer::kFileUnknown) return type;
-
-// This code was adapted from:
-// Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
-// See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
-#define UTF8_ACCEPT 0
-#define UTF8_REJECT 1
-
-  static constexpr const uint8_t utf8d[] = {
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 00..1f
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 20..3f
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 40..5f
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 60..7f
-      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
-      1,   1,   1,   1,   1,   9,   9,   9,   9,   9,   9,
-      9,   9,   9,   9,   9,   9,   9,   9,   9,   9,  // 80..9f
-      7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
-      7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
-      7,   7,   7,   7,   7,   7,   7,   7,   7,   7,  // a0..bf
-      8,   8,   2,   2,   2,   2,   2,   2,   2,   2,   2,
-      2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
-      2,   2,   2,   2,   2,   2,   2,   2,   2,   2,  // c0..df
-      0xa, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3,
-      0x3, 0x3, 0x4, 0x3, 0x3,  // e0..ef
-      0xb, 0x6, 0x6, 0x6, 0x5, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8,
-      0x8, 0x8, 0x8, 0x8, 0x8,  // f0..ff
-      0x0, 0x1, 0x2, 0x3, 0x5, 0x8, 0x7, 0x1, 0x1, 0x1, 0x4,
-      0x6, 0x1, 0x1, 0x1, 0x1,  // s0..s0
-      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
-      1,   1,   1,   1,   1,   1,   0,   1,   1,   1,   1,
-      1,   0,   1,   0,   1,   1,   1,   1,   1,   1,  // s1..s2
-      1,   2,   1,   1,   1,   1,   1,   2,   1,   2,   1,
-      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
-      1,   2,   1,   1,   1,   1,   1,   1,   1,   1,  // s3..s4
-      1,   2,   1,   1,   1,   1,   1,   1,   1,   2,   1,
-      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
-      1,   3,   1,   3,   1,   1,   1,   1,   1,   1,  // s5..s6
-      1,   3,   1,   1,   1,   1,   1,   3,   1,   3,   1,
-      1,   1,   1,   1,   1,   1,   3,   1,   1,   1,   1,
-      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  // s7..s8
-  };
-
-  size_t ascii = 0;
-  uint32_t state = UTF8_ACCEPT;
-  for (size_t i = 0; i < content.size(); i++) {
-    if (isascii(content[i])) {
-      ++ascii;
-      if (!isprint(content[i]) && !isspace(content[i]))
-        return FileRenderer::kFileBinary;
-      continue;
-    }
-
-    uint32_t type = utf8d[(uint8_t)content[i]];
-    state = utf8d[256 + state * 16 + type];
-
-    if (state == UTF8_REJECT) return FileRenderer::kFileBinary;
+// Returns kFilePrintable, kFileUtf8 or kFileBinary depending on content.
+FileRenderer::FileType GetFileTypeByContent(StringRef content) {
+  switch (ClassifyText(content.data(), content.size())) {
+    case kTextAscii:
+      return FileRenderer::kFilePrintable;
+    case kTextUtf8:
+      return FileRenderer::kFileUtf8;
+    case kTextBinary:
+      break;
   }
-  if (ascii == content.size()) return FileRenderer::kFilePrintable;
-  return FileRenderer::kFileUtf8;
+  return FileRenderer::kFileBinary;
 }
 
-bool FileRenderer::ReadFile(ParsedFile* file) {
-  static constexpr const size_t kLookSize = 16;
-  int rsize = std::min<size_t>(kLookSize, file->size);
-
-  std::string storage;
-  storage.resize(rsize);
-  // Read at most kLookSize bytes in memory.
-  std::ifstream ifile(file->path.c_str());
-  ifile.read(&storage[0], rsize);
-  if (!ifile) {
-    std::cerr << "WARNING: failed to read " << file->path << std::endl;
-    return false;
+// Reads size bytes from fd in buffer, handling short reads.
+static bool ReadAll(int fd, char* buffer, size_t size) {
+  while (size > 0) {
+    auto result = read(fd, buffer, size);
+    if (result < 0 && errno == EINTR) continue;
+    if (result <= 0) return false;
+    buffer += result;
+    size -= result;
   }
+  return true;
+}
 
-  // Helper to read whatever is left.
-  auto ReadRemaining = [&storage, rsize, file, &ifile]() -> bool {
-    storage.resize(file->size);
-    ifile.read(&storage[rsize], file->size - rsize);
-    if (!ifile) {
-      std::cerr << "WARNING: error reading " << file->path << std::endl;
+bool FileRenderer::ClassifyFile(int dirfd, ParsedFile* file) {
+  const char* extension = nullptr;
+  file->type = GetFileTypeByExtension(file->name, &extension);
+  if (file->type == kFileMedia) file->extension = extension;
+  if (file->type != kFileUnknown) return true;
+
+  // The whole file is classified, so binary data past the beginning of a
+  // text file is caught. Files larger than kReadSize are mapped instead of
+  // read. Either way, the file is read again when output.
+  static constexpr const size_t kReadSize = 4096;
+  if (static_cast<size_t>(file->size) > kReadSize) {
+    MappedFile content;
+    if (!content.Open(dirfd, file->name.str())) {
+      std::cerr << "WARNING: failed to map " + file->path.str() + "\n";
+      file->type = kFileBinary;
       return false;
     }
+    file->type = GetFileTypeByContent(content.data());
     return true;
-  };
-
-  const char* extension = nullptr;
-  file->type = GetFileType(file->name, storage, &extension);
-  // std::cerr << "FILE " << file->name <<  " " << file->type << " " <<
-  // (extension ? extension : "none") <<  " " << kFilePrintable << " " <<
-  // kFileUtf8 << std::endl;
-
-  switch (file->type) {
-    case kFileUnknown:
-      file->type = kFileBinary;
-    case kFileBinary:
-      file->body = "&lt;unparsable blob&gt;";
-      break;
-
-    case kFilePrintable:
-    case kFileUtf8:
-      if (!ReadRemaining()) return false;
-      file->body = html::EscapeText(storage);
-      break;
-
-    case kFileMedia:
-      if (!ReadRemaining()) return false;
-      file->body = std::move(storage);
-      file->extension = extension;
-      break;
+  }
 
-    case kFileHtml:
-      if (!ReadRemaining()) return false;
-      file->body = std::move(storage);
-      break;
+  char storage[kReadSize];
+  const size_t rsize = file->size;
 
-    case kFileParsed:
-    case kFileGenerated:
-      break;
+  int fd = openat(dirfd, file->name.data(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "WARNING: failed to open " + file->path.str() + "\n";
+    file->type = kFileBinary;
+    return false;
   }
+  const bool read = ReadAll(fd, storage, rsize);
+  close(fd);
+  if (!read) {
+    std::cerr << "WARNING: failed to read " + file->path.str() + "\n";
+    file->type = kFileBinary;
+    return false;
+  }
+
+  file->type = GetFileTypeByContent(StringRef(storage, rsize));
   return true;
 }
 
-void FileRenderer::ScanTree(const std::string& start) {
-  std::regex exclude(gl_scan_filter_regex);
+// As returned by getdents64, not exported by glibc.
+struct LinuxDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+void FileRenderer::ScanDirectory(const NameMatcher& exclude,
+                                 ParsedDirectory* drecord,
+                                 std::vector<ParsedDirectory*>* subdirs) {
+  std::cerr << "SCANNING " + drecord->path.str() + "\n";
+  int fd = open(drecord->path.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "ERROR: could not open dir " + drecord->path.str() + "\n";
+    return;
+  }
 
-  std::queue<ParsedDirectory*> to_scan;
-  to_scan.push(GetDirectoryFor(start));
+  alignas(LinuxDirent64) char buffer[32 * 1024];
+  while (true) {
+    auto size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    if (size < 0) {
+      std::cerr << "ERROR: could not read dir " + drecord->path.str() + "\n";
+      break;
+    }
+    if (size == 0) break;
 
-  while (!to_scan.empty()) {
-    auto* drecord = to_scan.front();
-    to_scan.pop();
+    for (long offset = 0; offset < size;) {
+      const auto* entry = reinterpret_cast<LinuxDirent64*>(buffer + offset);
+      offset += entry->d_reclen;
 
-    std::cerr << "SCANNING " << drecord->path << std::endl;
-    auto* fd = opendir(drecord->path.c_str());
-    if (!fd) {
-      std::cerr << "ERROR: could not open dir " << drecord->path << std::endl;
-      continue;
-    }
-    while (auto* entry = readdir(fd)) {
-      if (!gl_scan_filter_regex.empty() &&
-          std::regex_search(entry->d_name, exclude)) {
-        std::cerr << "REGEX MATCHED: " << entry->d_name << std::endl;
+      const StringRef name(entry->d_name);
+      if (name == "." || name == "..") continue;
+      if (exclude.Matches(name)) {
+        std::cerr << "REGEX MATCHED: " + name.str() + "\n";
         continue;
       }
 
-      if (entry->d_type == DT_DIR) {
-        if (*entry->d_name == '.') continue;
+      // Some filesystems do not fill in the type.
+      struct stat stats;
+      bool stated = false;
+      auto type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        if (fstatat(fd, entry->d_name, &stats, AT_SYMLINK_NOFOLLOW) != 0)
+          continue;
+        stated = true;
+        type = S_ISDIR(stats.st_mode) ? DT_DIR
+                                      : S_ISREG(stats.st_mode) ? DT_REG : 0;
+      }
 
-        const auto& insert = drecord->directories.emplace(std::make_pair(
-            entry->d_name, ParsedDirectory(drecord, entry->d_name)));
-        auto* dir = &insert.first->second;
-        to_scan.push(dir);
+      if (type == DT_DIR) {
+        if (name[0] == '.') continue;
+
+        subdirs->push_back(GetChildDirectory(drecord, name));
         continue;
       }
 
-      if (entry->d_type == DT_REG) {
-        const auto& insert = drecord->files.emplace(
-            std::make_pair(entry->d_name, ParsedFile(drecord, entry->d_name)));
-        auto* file = &insert.first->second;
+      if (type == DT_REG) {
+        auto* file = GetChildFile(drecord, name);
         if (file->Rendered()) continue;
-        struct stat stats;
-        int err = stat(file->path.c_str(), &stats);
-        if (err != 0) {
-          std::cerr << "WARNING: could not stat() " << file->path << std::endl;
+        if (!stated && fstatat(fd, entry->d_name, &stats, 0) != 0) {
+          std::cerr << "WARNING: could not stat() " + file->path.str() + "\n";
           continue;
         }
 
         file->size = stats.st_size;
         file->mtime = stats.st_mtime;
 
-        ReadFile(file);
+        ClassifyFile(fd, file);
         continue;
       }
-
-      if (entry->d_type == DT_LNK) {
-      }
     }
-    closedir(fd);
   }
+  close(fd);
+}
+
+void FileRenderer::ScanTree(const std::string& start) {
+  const NameMatcher exclude(gl_scan_filter_regex);
+
+  // Each directory is scanned by one thread, which also stats and reads its
+  // files. Subdirectories found are queued for any thread to pick up.
+  std::mutex lock;
+  std::condition_variable changed;
+  std::vector<ParsedDirectory*> to_scan({GetDirectoryFor(start)});
+  unsigned scanning = 0;
+
+  auto Worker = [&]() {
+    std::vector<ParsedDirectory*> subdirs;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      changed.wait(guard, [&]() { return !to_scan.empty() || !scanning; });
+      if (to_scan.empty()) break;
+
+      auto* drecord = to_scan.back();
+      to_scan.pop_back();
+      ++scanning;
+      guard.unlock();
+
+      ScanDirectory(exclude, drecord, &subdirs);
+
+      guard.lock();
+      --scanning;
+      to_scan.insert(to_scan.end(), subdirs.begin(), subdirs.end());
+      subdirs.clear();
+      changed.notify_all();
+    }
+  };
+
+  unsigned jobs = gl_scan_jobs;
+  if (!jobs) jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs; ++i) threads.emplace_back(Worker);
+  Worker();
+  for (auto& thread : threads) thread.join();
+}
+
+StringRef FileRenderer::InternPath(const std::string& path) {
+  static MemPool<char, uint64_t> pool("renderer-paths");
+
+  const auto offset = pool.Allocate(path.size() + 1);
+  char* interned = pool.Get(offset);
+  memcpy(interned, path.c_str(), path.size() + 1);
+  return StringRef(interned, path.size());
+}
+
+FileRenderer::ParsedDirectory* FileRenderer::GetChildDirectory(
+    ParsedDirectory* parent, StringRef name) {
+  auto found = parent->directories.find(name);
+  if (found != parent->directories.end()) return &found->second;
+
+  std::string path = parent->path.str();
+  if (parent->parent) path.push_back('/');
+  path.append(name.data(), name.size());
+  ParsedDirectory child(parent, InternPath(path));
+  return &parent->directories.emplace(child.name, std::move(child))
+              .first->second;
+}
+
+FileRenderer::ParsedFile* FileRenderer::GetChildFile(ParsedDirectory* parent,
+                                                     StringRef name) {
+  auto found = parent->files.find(name);
+  if (found != parent->files.end()) return &found->second;
+
+  std::string path = parent->path.str();
+  path.push_back('/');
+  path.append(name.data(), name.size());
+  ParsedFile child(parent, InternPath(path));
+  return &parent->files.emplace(child.name, std::move(child)).first->second;
 }
 
 // Note that empty directories are possible, for example, a path like:
@@ -328,7 +436,6 @@ FileRenderer::ParsedDirectory* FileRenderer::GetDirectoryFor(
   // std::cerr << "PATH " << path << std::endl;
   do {
     auto slash = path.find('/', position);
-    std::string dir;
     if (slash == std::string::npos) slash = path.size();
 
     // Handles paths like "/foo" or "///foo", which are the same.
@@ -336,14 +443,13 @@ FileRenderer::ParsedDirectory* FileRenderer::GetDirectoryFor(
       position = slash + 1;
       continue;
     }
-    dir = path.substr(position, slash - position);
+    const StringRef dir(path.data() + position, slash - position);
     //    std::cerr << dir << " ";
 
     if (dir == "..") {
       if (node->parent) node = node->parent;
     } else if (dir != ".") {
-      auto result = node->directories.emplace(dir, ParsedDirectory(node, dir));
-      node = &result.first->second;
+      node = GetChildDirectory(node, dir);
     }
     position = slash + 1;
   } while (position < path.size());
@@ -373,11 +479,7 @@ FileRenderer::GetDirectoryAndFileFor(const std::string& path) {
   ParsedDirectory* node = GetDirectoryFor(dirname);
   ParsedFile* file = nullptr;
 
-  if (!filename.empty()) {
-    auto result =
-        node->files.emplace(filename, std::move(ParsedFile(node, filename)));
-    file = &result.first->second;
-  }
+  if (!filename.empty()) file = GetChildFile(node, filename);
 
   // Never reached.
   return std::make_pair(node, file);
@@ -399,24 +501,40 @@ void FileRenderer::RenderFile(const SourceManager& sm, ParsedFile* file,
 }
 
 bool FileRenderer::OutputJFiles() {
-  std::deque<ParsedDirectory*> to_output({&absolute_root_});
-  while (!to_output.empty()) {
-    auto* node = to_output.front();
+  std::vector<ParsedDirectory*> dirs({&absolute_root_});
+  std::vector<std::pair<ParsedDirectory*, ParsedFile*>> files;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    auto* node = dirs[i];
+    for (auto& element : node->files)
+      files.emplace_back(node, &element.second);
+    for (auto& element : node->directories)
+      dirs.emplace_back(&element.second);
+  }
+
+  // Largest files first, so no thread is left with a large file at the end.
+  std::stable_sort(files.begin(), files.end(),
+                   [](const std::pair<ParsedDirectory*, ParsedFile*>& first,
+                      const std::pair<ParsedDirectory*, ParsedFile*>& second) {
+                     return first.second->size > second.second->size;
+                   });
+
+  // Directories are output first, as they need the type of the files,
+  // which OutputJFile changes.
+  RunParallel(dirs.size(), gl_output_jobs, [this, &dirs](size_t index) {
+    auto* node = dirs[index];
     if (!OutputJDirectory(node)) {
-      llvm::errs() << "ERROR: Could not output directory '" << node->name
-                   << "' aka " << node->path << "\n";
+      std::cerr << "ERROR: Could not output directory '" + node->name.str() +
+                       "' aka " + node->path.str() + "\n";
     }
-
-    to_output.pop_front();
-    for (auto& element : node->files) {
-      if (!OutputJFile(*node, &element.second)) {
-        llvm::errs() << "ERROR: Could not output file '" << element.second.name
-                     << "'\n";
-      }
+  });
+  RunParallel(files.size(), gl_output_jobs, [this, &files](size_t index) {
+    auto& element = files[index];
+    if (!OutputJFile(*element.first, element.second)) {
+      std::cerr << "ERROR: Could not output file '" +
+                       element.second->name.str() +
+                       "'\n";
     }
-    for (auto& element : node->directories)
-      to_output.emplace_back(&element.second);
-  }
+  });
   return true;
 }
 
@@ -425,7 +543,7 @@ std::string FileRenderer::GetNormalizedPath(const std::string& filename) {
   ParsedDirectory* directory;
   ParsedFile* file;
   std::tie(directory, file) = GetDirectoryAndFileFor(filename);
-  return file->path;
+  return file->path.str();
 }
 
 void FileRenderer::OutputJOther() {
@@ -436,58 +554,82 @@ void FileRenderer::OutputJOther() {
     return;
   }
 
-  std::ofstream myfile;
-  myfile.open(globals);
-  json::OStreamWrapper osw(myfile);
-  json::PrettyWriter<json::OStreamWrapper> writer(osw);
-  auto jdata = MakeJsonObject(&writer);
-  OutputJNavbar(&writer, "", "", nullptr, nullptr);
+  FileWriter output;
+  if (!output.Open(globals)) return;
+  {
+    json::PrettyWriter<FileWriter> writer(output);
+    auto jdata = MakeJsonObject(&writer);
+    OutputJNavbar(&writer, "", "", nullptr, nullptr);
+  }
+  if (!output.Close()) return;
+  if (gl_precompress)
+    PrecompressFile(globals);
+  else
+    RemovePrecompressed(globals);
+}
+
+// Children are kept in hash tables, this returns them sorted by name.
+template <typename NodeT>
+static std::vector<const NodeT*> SortedChildren(
+    const FileRenderer::Children<NodeT>& children) {
+  std::vector<const NodeT*> sorted;
+  sorted.reserve(children.size());
+  for (const auto& child : children) sorted.push_back(&child.second);
+  std::sort(sorted.begin(), sorted.end(),
+            [](const NodeT* first, const NodeT* second) {
+              return first->name < second->name;
+            });
+  return sorted;
 }
 
 void FileRenderer::OutputJsonTree(const char* path, const char* tag) {
   std::string basename = tag ? std::string("index.") + tag : "index";
   const auto& filepath = JoinPath({path, basename + ".files.json"});
 
-  std::ofstream myfile;
-  myfile.open(filepath);
-  json::OStreamWrapper osw(myfile);
-  json::PrettyWriter<json::OStreamWrapper> writer(osw);
+  FileWriter output;
+  if (!output.Open(filepath)) return;
+  {
+    json::PrettyWriter<FileWriter> writer(output);
 
-  auto jdata = MakeJsonObject(&writer);
-  auto files = MakeJsonArray(&writer, "data");
+    auto jdata = MakeJsonObject(&writer);
+    auto files = MakeJsonArray(&writer, "data");
 
-  // TODO: root is not output.
-  std::deque<const ParsedDirectory*> to_output({&absolute_root_});
-  while (!to_output.empty()) {
-    auto* node = to_output.front();
-    to_output.pop_front();
+    // TODO: root is not output.
+    std::deque<const ParsedDirectory*> to_output({&absolute_root_});
+    while (!to_output.empty()) {
+      auto* node = to_output.front();
+      to_output.pop_front();
 
-    {
-      const ParsedDirectory* parent = node->parent;
-      const ParsedDirectory& current = *node;
+      {
+        const ParsedDirectory* parent = node->parent;
+        const ParsedDirectory& current = *node;
 
-      auto dir = MakeJsonObject(&writer);
-      WriteJsonKeyValue(&writer, "dir", GetUserPath(current.path));
-      WriteJsonKeyValue(&writer, "href", current.HtmlPath());
+        auto dir = MakeJsonObject(&writer);
+        WriteJsonKeyValue(&writer, "dir", GetUserPath(current.path));
+        WriteJsonKeyValue(&writer, "href", current.HtmlPath());
 
-      if (parent) WriteJsonKeyValue(&writer, "parent", parent->HtmlPath());
-    }
+        if (parent) WriteJsonKeyValue(&writer, "parent", parent->HtmlPath());
+      }
 
-    for (auto& element : node->files) {
-      const ParsedDirectory& parent = *node;
-      const ParsedFile& file = element.second;
+      for (const auto* element : SortedChildren(node->files)) {
+        const ParsedDirectory& parent = *node;
+        const ParsedFile& file = *element;
 
-      auto dfile = MakeJsonObject(&writer);
-      WriteJsonKeyValue(&writer, "file", GetUserPath(file.path));
-      WriteJsonKeyValue(&writer, "parent", parent.HtmlPath());
-      WriteJsonKeyValue(&writer, "href", file.HtmlPath());
-    }
+        auto dfile = MakeJsonObject(&writer);
+        WriteJsonKeyValue(&writer, "file", GetUserPath(file.path));
+        WriteJsonKeyValue(&writer, "parent", parent.HtmlPath());
+        WriteJsonKeyValue(&writer, "href", file.HtmlPath());
+      }
 
-    for (auto& element : node->directories) {
-      const ParsedDirectory& current = element.second;
-      to_output.emplace_back(&current);
+      for (const auto* element : SortedChildren(node->directories))
+        to_output.emplace_back(element);
     }
   }
+  if (!output.Close()) return;
+  if (gl_precompress)
+    PrecompressFile(filepath);
+  else
+    RemovePrecompressed(filepath);
 }
 
 void FileRenderer::RawHighlight(FileID parsing_fid, Preprocessor& pp,
@@ -563,12 +705,9 @@ void FileRenderer::RawHighlight(FileID parsing_fid, Preprocessor& pp,
 
       case tok::raw_identifier: {
         //      std::cerr << "TOKEN RAW " << std::endl;
-        auto name = token.getRawIdentifier().str();
         auto* info = pp.LookUpIdentifierInfo(token);
         if (info && info->isKeyword(pp.getLangOpts())) {
-          //       std::cerr << "TOKEN KEYWORD " << name << std::endl;
-          WrapWithTag(file, offset, offset + token_length,
-                      MakeTag("span", {"keyword", name}, {}));
+          WrapWithTag(file, offset, offset + token_length, MakeKeywordTag());
         }
         break;
       }
@@ -576,7 +715,7 @@ void FileRenderer::RawHighlight(FileID parsing_fid, Preprocessor& pp,
       case tok::comment:
         //      std::cerr << "TOKEN COMMENT " << std::endl;
         WrapWithTag(file, offset, offset + token_length,
-                    MakeTag("span", {"comment"}, {}));
+                    MakeSpanTag("comment"));
         break;
       case tok::utf8_string_literal:
         // Chop off the u part of u8 prefix
@@ -593,11 +732,11 @@ void FileRenderer::RawHighlight(FileID parsing_fid, Preprocessor& pp,
       case tok::string_literal:
         // FIXME: Exclude the optional ud-suffix from the highlighted range.
         WrapWithTag(file, offset, offset + token_length,
-                    MakeTag("span", {"string"}, {}));
+                    MakeSpanTag("string"));
         break;
       case tok::numeric_constant:
         WrapWithTag(file, offset, offset + token_length,
-                    MakeTag("span", {"numeric"}, {}));
+                    MakeSpanTag("numeric"));
         break;
       case tok::utf8_char_constant:
         ++offset;
@@ -610,7 +749,7 @@ void FileRenderer::RawHighlight(FileID parsing_fid, Preprocessor& pp,
         --token_length;
       case tok::char_constant:
         WrapWithTag(file, offset, offset + token_length,
-                    MakeTag("span", {"char"}, {}));
+                    MakeSpanTag("char"));
         break;
       case tok::hash: {
         // If this is a preprocessor directive, all tokens to end of line are
@@ -628,7 +767,7 @@ void FileRenderer::RawHighlight(FileID parsing_fid, Preprocessor& pp,
 
         // Find end of line.  This is a hack.
         WrapWithTag(file, offset, token_end,
-                    MakeTag("span", {"directive"}, {}));
+                    MakeSpanTag("directive"));
 
         // Don't skip the next token.
         continue;
@@ -652,71 +791,327 @@ std::string FileRenderer::FormatSource(Preprocessor& pp, FileID fid,
   return retval;
 }
 
+// With --objects-dir or --incremental-output, outputs are written to a
+// temporary file while hashing their content, and moved in place by
+// CloseOutput.
+static bool HashOutputs() {
+  return !gl_objects_dir.empty() || gl_incremental_output;
+}
+
+// The file is always created anew, never truncated: an earlier run with
+// --objects-dir may have left a hard link to an object shared by all tags,
+// which must not be rewritten.
+static bool CreateOutput(FileWriter* output, const std::string& path) {
+  if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+    std::cerr << "ERROR: could not remove " + path + ": " + strerror(errno) +
+                     "\n";
+    return false;
+  }
+  return output->Open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+}
+
+static bool OpenOutput(FileWriter* output, const std::string& path) {
+  if (!HashOutputs()) return CreateOutput(output, path);
+
+  output->HashContent();
+  return CreateOutput(output, path + ".tmp");
+}
+
+// Links the temporary file written by OpenOutput in the objects directory,
+// unless an identical object is already there.
+static void StoreObject(const FileWriter& output, const std::string& tmp) {
+  const StringRef hash = output.ContentHash();
+  const auto& object =
+      JoinPath({gl_objects_dir, hash.substr(0, 2), hash.substr(2)});
+  if (!MakeDirs(object, 0777)) {
+    std::cerr << "ERROR: FAILED TO MAKE DIRS FOR OBJECT '" + object + "'\n";
+    return;
+  }
+
+  if (link(tmp.c_str(), object.c_str()) == 0) return;
+  if (errno != EEXIST) {
+    std::cerr << "ERROR: could not link " + tmp + " to " + object + ": " +
+                     strerror(errno) + "\n";
+    return;
+  }
+
+  // Same content as an existing object: use the object instead.
+  if (unlink(tmp.c_str()) < 0 || link(object.c_str(), tmp.c_str()) < 0) {
+    std::cerr << "ERROR: could not link " + object + " to " + tmp + ": " +
+                     strerror(errno) + "\n";
+    return;
+  }
+  c_objects_deduplicated.Increment(1);
+  c_objects_bytes_saved.Increment(output.size());
+}
+
+bool CheckObjectsDir() {
+  if (gl_objects_dir.empty()) return true;
+
+  const auto& probe = MakeMetaPath("objects-dir.probe");
+  const auto& object =
+      JoinPath({gl_objects_dir, "probe." + std::to_string(getpid())});
+  if (!MakeDirs(probe, 0777) || !MakeDirs(object, 0777)) {
+    std::cerr << "ERROR: FAILED TO MAKE DIRS FOR '" + probe + "' OR '" +
+                     object + "'\n";
+    return false;
+  }
+
+  FileWriter output;
+  if (!CreateOutput(&output, probe) || !output.Close()) return false;
+  const bool linked = link(probe.c_str(), object.c_str()) == 0;
+  if (!linked) {
+    std::cerr << "ERROR: could not link " + probe + " to " + object + ": " +
+                     strerror(errno) +
+                     (errno == EXDEV ? ", --objects-dir must be on the same "
+                                       "filesystem as the output"
+                                     : "") +
+                     "\n";
+  }
+  unlink(object.c_str());
+  unlink(probe.c_str());
+  return linked;
+}
+
+// If changed is not nullptr, it is set to false when path is left as it was,
+// having the same content as in the previous run.
+static bool CloseOutput(FileWriter* output, const std::string& path,
+                        bool* changed = nullptr) {
+  if (changed) *changed = true;
+  const bool closed = output->Close();
+  if (!HashOutputs()) return closed;
+
+  const auto& tmp = path + ".tmp";
+  if (closed && gl_incremental_output &&
+      GlobalOutputManifest().Unchanged(path, output->ContentHash())) {
+    // Keeps the mtime, and whatever was cached, of the existing file.
+    unlink(tmp.c_str());
+    if (changed) *changed = false;
+    return true;
+  }
+
+  bool renamed = false;
+  if (closed) {
+    // If StoreObject fails, tmp is still moved in place, not deduplicated.
+    if (!gl_objects_dir.empty()) StoreObject(*output, tmp);
+    renamed = rename(tmp.c_str(), path.c_str()) == 0;
+    if (!renamed) {
+      std::cerr << "ERROR: could not rename " + tmp + " to " + path + ": " +
+                       strerror(errno) + "\n";
+    }
+  }
+  // If path was already a link to the same object, rename does nothing.
+  unlink(tmp.c_str());
+
+  // Whatever is at path now, the manifest must not claim the new content
+  // unless it is in place. Without a hash, the file is kept, but rewritten
+  // by the next run.
+  if (gl_incremental_output) {
+    GlobalOutputManifest().Record(
+        path, renamed ? output->ContentHash() : std::string());
+  }
+  return renamed;
+}
+
+// An unchanged output keeps its compressed copies, if it has them already.
+// Without --precompress, copies left by earlier runs are removed.
+static bool PrecompressOutput(const std::string& path, bool changed) {
+  if (!gl_precompress) {
+    RemovePrecompressed(path);
+    return true;
+  }
+  if (!changed && access((path + ".gz").c_str(), F_OK) == 0) return true;
+  return PrecompressFile(path);
+}
+
+static bool OutputLineIndex(const std::string& path, const HtmlLines& lines) {
+  FileWriter output;
+  if (!OpenOutput(&output, path)) return false;
+
+  // The fields of LineIndex, before the offsets.
+  const uint32_t header[] = {static_cast<uint32_t>(lines.offsets.size() - 1),
+                             static_cast<uint32_t>(lines.page_lines)};
+  static_assert(sizeof(header) == offsetof(LineIndex, offset),
+                "LineIndex header does not match cindex.h");
+  output.append(reinterpret_cast<const char*>(header), sizeof(header));
+  output.append(reinterpret_cast<const char*>(lines.offsets.data()),
+                lines.offsets.size() * sizeof(lines.offsets[0]));
+  return CloseOutput(&output, path);
+}
+
+// Makes path at least as recent as than, unless it already is.
+static void TouchIfOlder(const std::string& path, const struct stat& than) {
+  struct stat stats;
+  if (stat(path.c_str(), &stats) < 0) return;
+  if (stats.st_mtim.tv_sec > than.st_mtim.tv_sec ||
+      (stats.st_mtim.tv_sec == than.st_mtim.tv_sec &&
+       stats.st_mtim.tv_nsec >= than.st_mtim.tv_nsec))
+    return;
+  if (utimensat(AT_FDCWD, path.c_str(), nullptr, 0) < 0) {
+    std::cerr << "WARNING: could not update mtime of " + path + ": " +
+                     strerror(errno) + "\n";
+  }
+}
+
+// Must be called once the .jhtml file at html_path is in place: the server
+// ignores annotations older than it, left behind by a run without
+// --annotations.
+static bool OutputAnnotations(FileRenderer::ParsedFile* file,
+                              const std::string& html_path) {
+  const auto& source_path = file->SourcePath(".jsrc");
+  FileWriter source;
+  if (!OpenOutput(&source, source_path)) return false;
+  source.append(file->body);
+
+  const auto& annotations_path = file->SourcePath(".jann");
+  FileWriter annotations;
+  if (!OpenOutput(&annotations, annotations_path)) return false;
+  file->rewriter.Annotate(file->body, &annotations);
+
+  if (!CloseOutput(&source, source_path) ||
+      !CloseOutput(&annotations, annotations_path))
+    return false;
+
+  // Unchanged or deduplicated outputs keep the mtime of an older file.
+  struct stat html;
+  if (stat(html_path.c_str(), &html) == 0) {
+    TouchIfOlder(source_path, html);
+    TouchIfOlder(annotations_path, html);
+  }
+  return true;
+}
+
+// Removes the files written by OutputAnnotations in a previous run, so the
+// server does not render them in place of the new .jhtml.
+static void RemoveAnnotations(FileRenderer::ParsedFile* file) {
+  unlink(file->SourcePath(".jsrc").c_str());
+  unlink(file->SourcePath(".jann").c_str());
+}
+
 bool FileRenderer::OutputJFile(const ParsedDirectory& parent,
                                ParsedFile* file) {
   const auto& path = file->SourcePath(".jhtml");
-  std::cerr << "GENERATING JFILE " << file->path << " " << path << std::endl;
+  std::cerr << "GENERATING JFILE " + file->path.str() + " " + path + "\n";
   if (!MakeDirs(path, 0777)) {
     std::cerr << "ERROR: FAILED TO MAKE DIRS FOR FILE '" << path << "'"
               << std::endl;
     return false;
   }
 
-  std::ofstream myfile;
   if (file->type == kFileMedia) {
     // We need to maintain the original extension in this case.
-    const auto& path = file->SourcePath();
-    myfile.open(path);
-    // TODO: use hard links, fall back to copy.
-    myfile.write(file->body.c_str(), file->body.size());
-    return true;
+    if (gl_incremental_output)
+      GlobalOutputManifest().Record(file->SourcePath());
+    return LinkOrCopyFile(file->path.str(), file->SourcePath(), gl_link_files);
   }
+  const bool raw_blob = gl_output_blobs && file->type == kFileBinary;
+  if (raw_blob && gl_incremental_output)
+    GlobalOutputManifest().Record(file->SourcePath(".raw"));
+  if (raw_blob &&
+      !LinkOrCopyFile(file->path.str(), file->SourcePath(".raw"),
+                      gl_link_files))
+    return false;
 
-  myfile.open(path);
+  // Files found by ScanTree are only read now, and only for as long as
+  // it takes to write them out.
+  MappedFile source;
+  switch (file->type) {
+    case kFileHtml:
+    case kFilePrintable:
+    case kFileUtf8:
+      if (!source.Open(file->path.str())) return false;
+      break;
+
+    default:
+      break;
+  }
+
+  FileWriter output;
+  bool annotate = false;
+
+  if (!OpenOutput(&output, path)) return false;
   {
-    json::OStreamWrapper osw(myfile);
-    json::Writer<json::OStreamWrapper> writer(osw);
+    json::Writer<FileWriter> writer(output);
 
     auto jdata = MakeJsonObject(&writer);
     OutputJNavbar(&writer, file->name, file->path, nullptr, &parent);
   }
 
-  AddJHtmlSeparator(&myfile);
+  AddJHtmlSeparator(&output);
   switch (file->type) {
     case FileRenderer::kFileHtml:
-      myfile << html::EscapeText(file->body);
-      break;
-
     case FileRenderer::kFilePrintable:
     case FileRenderer::kFileUtf8:
-    case FileRenderer::kFileUnknown:
+      AppendEscapedHtml(&output, source.data().data(), source.data().size());
+      break;
+
     case FileRenderer::kFileBinary:
-      myfile << file->body;
+      if (raw_blob) {
+        output.append("&lt;unparsable blob, <a href='");
+        output.append(MakeHtmlPath(file->hash, ".raw"));
+        output.append("'>download</a>&gt;");
+        break;
+      }
+      output.append("&lt;unparsable blob&gt;");
       break;
 
-    case FileRenderer::kFileParsed:
+    case FileRenderer::kFileUnknown:
+      break;
+
+    case FileRenderer::kFileParsed: {
+      // The html is streamed to the file as it is generated. Neither the
+      // html nor the source are needed afterwards.
       file->type = FileRenderer::kFileGenerated;
-      file->body = file->rewriter.Generate(file->path, file->body);
-      /* NO BREAK HERE */
+      if (gl_annotations) {
+        // Written after the .jhtml file, see OutputAnnotations.
+        annotate = true;
+        break;
+      }
+      RemoveAnnotations(file);
+
+      HtmlLines lines;
+      lines.page_lines = gl_page_lines;
+      file->rewriter.Generate(file->path, file->body, &output,
+                              gl_line_index ? &lines : nullptr);
+      std::string().swap(file->body);
+
+      if (gl_line_index &&
+          !OutputLineIndex(file->SourcePath(".jlines"), lines)) {
+        std::cerr << "ERROR: FAILED TO OUTPUT LINE INDEX FOR '" << path << "'"
+                  << std::endl;
+      }
+      break;
+    }
 
     case FileRenderer::kFileGenerated:
-      myfile << file->body;
+      std::cerr << "ERROR: FILE " << file->path.str()
+                << " WAS ALREADY GENERATED, BODY IS GONE" << std::endl;
       break;
     case FileRenderer::kFileMedia:
       abort();
       break;
   }
-  return true;
+  bool changed;
+  const bool closed = CloseOutput(&output, path, &changed);
+  if (annotate) {
+    if (closed && !OutputAnnotations(file, path)) {
+      std::cerr << "ERROR: FAILED TO OUTPUT ANNOTATIONS FOR '" << path << "'"
+                << std::endl;
+    }
+    std::string().swap(file->body);
+  }
+  if (!closed) return false;
+  return PrecompressOutput(path, changed);
 }
 
-void FileRenderer::OutputJNavbar(json::Writer<json::OStreamWrapper>* writer,
-                                 const std::string& name,
-                                 const std::string& path,
+template <typename WriterT>
+void FileRenderer::OutputJNavbar(WriterT* writer, StringRef name,
+                                 StringRef path,
                                  const FileRenderer::ParsedDirectory* current,
                                  const FileRenderer::ParsedDirectory* parent) {
   // Build stack of parent directories, and find root.
   const FileRenderer::ParsedDirectory* root = stripping_root_;
-  static std::deque<const FileRenderer::ParsedDirectory*> stack;
+  std::vector<const FileRenderer::ParsedDirectory*> stack;
   for (const auto* cursor = current ? current : parent;
        cursor && cursor != root; cursor = cursor->parent) {
     if (!cursor->parent) {
@@ -747,17 +1142,16 @@ void FileRenderer::OutputJNavbar(json::Writer<json::OStreamWrapper>* writer,
 
 bool FileRenderer::OutputJDirectory(ParsedDirectory* dir) {
   const auto& path = dir->SourcePath(".jhtml");
-  std::cerr << "GENERATING JDIR " << dir->path << " " << path << std::endl;
+  std::cerr << "GENERATING JDIR " + dir->path.str() + " " + path + "\n";
   if (!MakeDirs(path, 0777)) {
     std::cerr << "ERROR: FAILED TO MAKE DIRS FOR '" << path << "'" << std::endl;
     return false;
   }
 
-  std::ofstream myfile;
-  myfile.open(path);
+  FileWriter output;
+  if (!OpenOutput(&output, path)) return false;
   {
-    json::OStreamWrapper osw(myfile);
-    json::Writer<json::OStreamWrapper> writer(osw);
+    json::Writer<FileWriter> writer(output);
 
     auto jdata = MakeJsonObject(&writer);
     OutputJNavbar(&writer, dir->name, dir->path, dir, dir->parent);
@@ -765,9 +1159,9 @@ bool FileRenderer::OutputJDirectory(ParsedDirectory* dir) {
     std::string code;
     if (!dir->files.empty()) {
       auto files = MakeJsonArray(&writer, "files");
-      for (const auto& it : dir->files) {
-        auto& filename = it.first;
-        auto& descriptor = it.second;
+      for (const auto* element : SortedChildren(dir->files)) {
+        auto& filename = element->name;
+        auto& descriptor = *element;
         auto file = MakeJsonObject(&writer);
 
         WriteJsonKeyValue(&writer, "name", filename);
@@ -795,7 +1189,8 @@ bool FileRenderer::OutputJDirectory(ParsedDirectory* dir) {
         }
 
         WriteJsonKeyValue(&writer, "href", descriptor.HtmlPath());
-        WriteJsonKeyValue(&writer, "mtime", ctime(&descriptor.mtime));
+        char mtime[26];
+        WriteJsonKeyValue(&writer, "mtime", ctime_r(&descriptor.mtime, mtime));
         WriteJsonKeyValue(&writer, "size",
                           static_cast<uint64_t>(descriptor.size));
       }
@@ -813,9 +1208,9 @@ bool FileRenderer::OutputJDirectory(ParsedDirectory* dir) {
         WriteJsonKeyValue(&writer, "name", "..");
       }
 
-      for (const auto& it : dir->directories) {
-        auto& name = it.first;
-        auto& descriptor = it.second;
+      for (const auto* element : SortedChildren(dir->directories)) {
+        auto& name = element->name;
+        auto& descriptor = *element;
         auto obj = MakeJsonObject(&writer);
 
         WriteJsonKeyValue(&writer, "href", descriptor.HtmlPath());
@@ -824,6 +1219,8 @@ bool FileRenderer::OutputJDirectory(ParsedDirectory* dir) {
       }
     }
   }
-  AddJHtmlSeparator(&myfile);
-  return true;
+  AddJHtmlSeparator(&output);
+  bool changed;
+  if (!CloseOutput(&output, path, &changed)) return false;
+  return PrecompressOutput(path, changed);
 }
@@ -32,12 +32,25 @@
 #include "base.h"
 #include "common.h"
 #include "json-helpers.h"
+#include "mempool.h"
 #include "rewriter.h"
 
+#include <unordered_map>
+
 class FileRenderer {
  public:
   struct ParsedDirectory;
 
+  struct NameHasher {
+    size_t operator()(StringRef name) const {
+      return HashBytes(name.data(), name.size());
+    }
+  };
+  // Children of a directory, by name. The names are the end of the path of
+  // each child, not a copy.
+  template <typename NodeT>
+  using Children = std::unordered_map<StringRef, NodeT, NameHasher>;
+
   enum FileType {
     kFileUnknown,
     kFileBinary,
@@ -53,10 +66,11 @@ class FileRenderer {
   };
 
   struct ParsedFile {
-    ParsedFile(ParsedDirectory* parent, const std::string& rname)
+    // path is interned, see InternPath.
+    ParsedFile(ParsedDirectory* parent, StringRef path)
         : parent(parent),
-          name(rname),
-          path(parent->path + "/" + rname),
+          name(path.substr(path.rfind('/') + 1)),
+          path(path),
           hash(hash_value(path)) {}
     bool Rendered() { return type != kFileUnknown; }
     bool Preprocessed() { return preprocessed; }
@@ -67,8 +81,9 @@ class FileRenderer {
     std::string HtmlPath() const { return MakeHtmlPath(hash, extension); }
 
     ParsedDirectory* parent = nullptr;
-    std::string name;
-    std::string path;
+    // Both point to the same interned string, and are 0 terminated.
+    StringRef name;
+    StringRef path;
     uint64_t hash;
 
     off_t size = 0;
@@ -86,12 +101,11 @@ class FileRenderer {
   };
 
   struct ParsedDirectory {
-    ParsedDirectory(ParsedDirectory* parent, const std::string& rname)
+    // path is interned, see InternPath.
+    ParsedDirectory(ParsedDirectory* parent, StringRef path)
         : parent(parent),
-          name(rname),
-          path(parent ? (parent->parent ? parent->path + "/" + rname
-                                        : parent->path + rname)
-                      : "/"),
+          name(path.substr(path.rfind('/') + 1)),
+          path(path),
           hash(hash_value(path)) {}
 
     std::string SourcePath(const char* extension = ".html") const {
@@ -102,12 +116,12 @@ class FileRenderer {
     }
 
     ParsedDirectory* parent = nullptr;
-    std::string name;
-    std::string path;
+    StringRef name;
+    StringRef path;
     uint64_t hash;
 
-    std::map<std::string, ParsedDirectory> directories;
-    std::map<std::string, ParsedFile> files;
+    Children<ParsedDirectory> directories;
+    Children<ParsedFile> files;
   };
 
   FileRenderer();
@@ -137,13 +151,26 @@ class FileRenderer {
  private:
   void RawHighlight(FileID parsing_fid, Preprocessor& pp, ParsedFile* file);
 
+  // Copies path in a pool shared by all the nodes of the tree. Returns a 0
+  // terminated string, valid for as long as the program runs.
+  static StringRef InternPath(const std::string& path);
+  // Return the child of parent called name, creating it if needed.
+  static ParsedDirectory* GetChildDirectory(ParsedDirectory* parent,
+                                            StringRef name);
+  static ParsedFile* GetChildFile(ParsedDirectory* parent, StringRef name);
+
   bool OutputJFile(const ParsedDirectory& dir, ParsedFile* file);
   bool OutputJDirectory(ParsedDirectory* dir);
 
-  bool ReadFile(ParsedFile* file);
+  // Sets the type of a file found by ScanTree, dirfd being its directory.
+  // Only looks at the extension, or the first few KB of the file.
+  bool ClassifyFile(int dirfd, ParsedFile* file);
+  // Adds the entries of drecord to the tree, returning its subdirectories.
+  void ScanDirectory(const NameMatcher& exclude, ParsedDirectory* drecord,
+                     std::vector<ParsedDirectory*>* subdirs);
 
-  void OutputJNavbar(json::Writer<json::OStreamWrapper>* writer,
-                     const std::string& name, const std::string& path,
+  template <typename WriterT>
+  void OutputJNavbar(WriterT* writer, StringRef name, StringRef path,
                      const FileRenderer::ParsedDirectory* current,
                      const FileRenderer::ParsedDirectory* parent);
 
@@ -154,12 +181,15 @@ class FileRenderer {
   // Parent directories to strip from output when rendering tree.
   ParsedDirectory* stripping_root_ = nullptr;
   // The absolute root of our in-memory tree.
-  ParsedDirectory absolute_root_{nullptr, ""};
+  ParsedDirectory absolute_root_{nullptr, "/"};
 };
 
-inline const std::string& GetFilePath(FileRenderer::ParsedFile* file) {
-  static const std::string fid_error{"<no-file-entry-corresponding-to-fid>"};
-  return file ? file->path : fid_error;
+// With --objects-dir, checks that files in the output directory can be
+// hard linked in the objects directory. Returns true without the flag.
+bool CheckObjectsDir();
+
+inline std::string GetFilePath(FileRenderer::ParsedFile* file) {
+  return file ? file->path.str() : "<no-file-entry-corresponding-to-fid>";
 }
 inline uint64_t GetFileHash(FileRenderer::ParsedFile* file) {
   return file ? file->hash : 0;
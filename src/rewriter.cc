@@ -27,149 +27,387 @@
 // policies, either expressed or implied, of Carlo Contavalli.
 
 #include "rewriter.h"
+#include "cindex.h"
+#include "counters.h"
+#include "escaping.h"
+#include "writer.h"
+
+#include <algorithm>
 #include <iostream>
 
-const char _kTagString[] = "Tag";
+Counter& c_duplicate_tags = MakeCounter(
+    "rewriter/tags/duplicate", "TAGS dropped as identical to one already added");
+Counter& c_duplicate_tags_bytes =
+    MakeCounter("rewriter/tags/duplicate-bytes",
+                "Bytes of memory saved by dropping duplicate TAGS");
 
-struct TagSet {
-  // HTML TAGS need to be nested correctly, for example:
-  //   <a><span></span></a>
-  // we need to open first the tags that are closed the latest,
-  // and close first the tags that were opened the latest.
+// HTML TAGS need to be nested correctly, for example:
+//   <a><span></span></a>
+// we need to open first the tags that are closed the latest,
+// and close first the tags that were opened the latest.
+//
+// Generate turns each tag in an open and a close event, with a 64 bit key:
+//   offset << 32 | phase << 31 | rank
+// where phase is 0 for closes, so they come before opens at the same offset,
+// and rank is the position of the tag once sorted by (open, largest close
+// first). Opens follow the rank, closes the reverse rank, so a single sort
+// of the keys gives the order in which to emit all the events.
+static constexpr uint64_t kEventOpen = 1ULL << 31;
+static constexpr uint64_t kEventRankMask = kEventOpen - 1;
 
-  // Lists the tags to open, sorted by the largest closing offset first.
-  std::multimap<ssize_t, Tag*, std::greater<ssize_t>> opens;
+// Stable LSD radix sort of keys, 8 bits at a time, carrying values along.
+// Passes where all the keys have the same digit are skipped, generally most
+// of the high bits of file offsets.
+template <typename ValueT>
+static void RadixSort(std::vector<uint64_t>* keys,
+                      std::vector<ValueT>* values) {
+  const size_t size = keys->size();
+  std::vector<uint64_t> keys_tmp(size);
+  std::vector<ValueT> values_tmp(values ? size : 0);
 
-  // Lists the tags to close, sorted by the largest opening offset first.
-  // Additionally, closes for opens in the same position should preserve
-  // the correct order.
-  std::multimap<ssize_t, Tag*, std::greater<ssize_t>> closes;
-};
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t counts[257] = {0};
+    for (const auto key : *keys) ++counts[((key >> shift) & 0xff) + 1];
+    if (std::find(std::begin(counts), std::end(counts), size) !=
+        std::end(counts))
+      continue;
 
-// Key is the offset, value is a set of tags to open or close at that offset.
-using TagSetsMap = std::map<ssize_t, std::unique_ptr<TagSet>>;
+    for (int i = 1; i < 257; ++i) counts[i] += counts[i - 1];
+    for (size_t i = 0; i < size; ++i) {
+      const auto position = counts[((*keys)[i] >> shift) & 0xff]++;
+      keys_tmp[position] = (*keys)[i];
+      if (values) values_tmp[position] = (*values)[i];
+    }
+    keys->swap(keys_tmp);
+    if (values) values->swap(values_tmp);
+  }
+}
 
-std::unique_ptr<TagSet>& GetTagset(TagSetsMap* ts, ssize_t position);
-bool AddOpen(TagSetsMap* ts, Tag* tag);
-bool AddClose(TagSetsMap* ts, Tag* tag, int order);
+// Classes are not hashed, they are almost always the same for a given range
+// and target. Tags differing only in classes end up in the same chain.
+static inline uint64_t HashTag(const Tag& tag) {
+  uint64_t hash = static_cast<uint64_t>(static_cast<uint32_t>(tag.open)) |
+                  static_cast<uint64_t>(tag.close) << 32;
+  hash ^= (tag.file + tag.kind) * 0x9e3779b97f4a7c15ULL;
+  hash ^= (tag.object.sl ^ tag.object.el << 17) * 0xc2b2ae3d27d4eb4fULL;
+  hash ^= hash >> 29;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  return hash ^ (hash >> 32);
+}
 
-uint64_t gl_bytes_wasted_on_duplication = 0;
+void HtmlRewriter::GrowIndex() {
+  std::vector<uint32_t> index(std::max<size_t>(index_.size() * 2, 64));
+  const size_t mask = index.size() - 1;
+  for (uint32_t i = 0; i < tags_.size(); ++i) {
+    size_t slot = HashTag(tags_[i]) & mask;
+    while (index[slot]) slot = (slot + 1) & mask;
+    index[slot] = i + 1;
+  }
+  index_.swap(index);
+}
 
-void HtmlRewriter::Add(Tag tag) { tags_.emplace_back(std::move(tag)); }
+void HtmlRewriter::Add(Tag tag) {
+  // Keep the load factor of the index below 1/2.
+  if (tags_.size() * 2 >= index_.size()) GrowIndex();
 
-std::unique_ptr<TagSet>& GetTagset(TagSetsMap* ts, ssize_t position) {
-  auto& tagset = (*ts)[position];
-  if (tagset == nullptr) tagset = std::move(llvm::make_unique<TagSet>());
-  return tagset;
+  const size_t mask = index_.size() - 1;
+  size_t slot = HashTag(tag) & mask;
+  for (; index_[slot]; slot = (slot + 1) & mask) {
+    if (tags_[index_[slot] - 1] == tag) {
+      c_duplicate_tags.Increment(1);
+      c_duplicate_tags_bytes.Increment(sizeof(Tag) + sizeof(uint32_t) * 2);
+      return;
+    }
+  }
+  index_[slot] = tags_.size() + 1;
+  tags_.emplace_back(std::move(tag));
 }
 
-bool AddOpen(TagSetsMap* ts, Tag* tag) {
-  if (tag->open < 0) return false;
-
-  auto& tagset = GetTagset(ts, tag->open);
-  auto it = tagset->opens.lower_bound(tag->close);
-  for (; it != tagset->opens.end(); ++it) {
-    if (it->first != tag->close) break;
-    if (*it->second == *tag) {
-      // gl_bytes_wasted_on_duplication += to_print.size();
-      // std::cerr << "AVOIDING DUP TAG " << filename.str() << " " << to_print
-      //           << " offset " << retval.size() << " wasted "
-      //           << GetHumanValue(gl_bytes_wasted_on_duplication) <<
-      //           std::endl;
-      return false;
+template <typename OutputT>
+void Tag::AppendAttributes(OutputT* output, const StringRef& body,
+                           bool reopened) const {
+  output->append("class='");
+  switch (kind) {
+    case kSpan:
+    case kInclude:
+      output->append(classes);
+      break;
+
+    case kKeyword: {
+      output->append(classes);
+      // The keyword itself is used as a second class. Skip it if it was
+      // split by an escaped newline, or the offsets are out of the body.
+      if (open < 0 || close <= open || static_cast<size_t>(close) > body.size())
+        break;
+      const auto& keyword = body.slice(open, close);
+      if (std::all_of(keyword.begin(), keyword.end(),
+                      [](unsigned char c) { return isalnum(c) || c == '_'; })) {
+        output->append(" ");
+        output->append(keyword.data(), keyword.size());
+      }
+      break;
     }
+
+    case kUse:
+      output->append(classes);
+      output->append("-uses");
+      break;
+
+    case kDefine:
+      output->append("def def-");
+      output->append(classes);
+      break;
+
+    case kDeclare:
+      output->append("decl decl-");
+      output->append(classes);
+      break;
   }
+  output->append("'");
 
-  tagset->opens.emplace_hint(it, std::make_pair(tag->close, tag));
-  return true;
-}
+  switch (kind) {
+    case kSpan:
+    case kKeyword:
+      break;
 
-bool AddClose(TagSetsMap* ts, Tag* tag, int order) {
-  if (tag->close < 0) return false;
+    case kUse:
+      output->append(" href='");
+      output->append(MakeHtmlPath(file));
+      output->append("#");
+      output->append(MakeIdName(object));
+      output->append("'");
+      break;
 
-  auto& tagset = GetTagset(ts, tag->close);
-  tagset->closes.emplace(std::make_pair((tag->open << 10) + order, tag));
-  return true;
+    case kInclude:
+      output->append(" href='");
+      output->append(MakeHtmlPath(file));
+      output->append("'");
+      break;
+
+    case kDefine:
+    case kDeclare:
+      if (reopened) break;
+      output->append(" id='");
+      output->append(MakeIdName(object));
+      output->append("'");
+      break;
+  }
 }
 
+template void Tag::AppendAttributes(std::string* output,
+                                    const StringRef& body,
+                                    bool reopened) const;
+template void Tag::AppendAttributes(FileWriter* output,
+                                    const StringRef& body,
+                                    bool reopened) const;
+
 std::string HtmlRewriter::Generate(const StringRef& filename,
                                    const StringRef& body) {
-  TagSetsMap tagsets;
-  for (auto& tag : tags_) AddOpen(&tagsets, &tag);
+  std::string retval;
+  Generate(filename, body, &retval);
+  retval.shrink_to_fit();
+  return retval;
+}
 
+std::vector<uint32_t> HtmlRewriter::SortTags() {
+  // Sort the tags by open offset, and largest close first, so outer
+  // tags are opened first. Ties keep the order tags were added in.
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> sorted;
+  keys.reserve(tags_.size());
+  sorted.reserve(tags_.size());
+  for (uint32_t i = 0; i < tags_.size(); ++i) {
+    const auto& tag = tags_[i];
+    if (tag.open < 0) continue;
+    keys.push_back(static_cast<uint64_t>(tag.open) << 32 |
+                   static_cast<uint32_t>(~std::max(tag.close, 0)));
+    sorted.push_back(i);
+  }
+  RadixSort(&keys, &sorted);
+
+  // Release the index, duplicates were already dropped by Add.
+  std::vector<uint32_t>().swap(index_);
+  return sorted;
+}
+
+template <typename OutputT>
+void HtmlRewriter::Generate(const StringRef& filename, const StringRef& body,
+                            OutputT* output, HtmlLines* lines) {
+  // 1) Sort the tags in the order they have to be opened.
+  const auto& sorted = SortTags();
+
+  // 2) Generate the events.
+  std::vector<uint64_t> events;
+  events.reserve(sorted.size() * 2);
+  for (uint64_t rank = 0; rank < sorted.size(); ++rank) {
+    const auto& tag = tags_[sorted[rank]];
+    events.push_back(static_cast<uint64_t>(tag.open) << 32 | kEventOpen |
+                     rank);
+    // Empty (or reversed) tags are closed right after being opened.
+    if (tag.close > tag.open)
+      events.push_back(static_cast<uint64_t>(tag.close) << 32 |
+                       (~rank & kEventRankMask));
+  }
+  RadixSort<uint32_t>(&events, nullptr);
+
+  // 3) Emit text and tags.
   const char* data = body.data();
-  const auto size = body.size();
+  const size_t size = body.size();
 
-  std::string retval;
-  auto CloseTag = [&retval](const Tag& tag) {
-    retval.append("</");
-    retval.append(tag.tag);
-    retval.append(">");
+  size_t pos = 0;
+  auto OpenTag = [output, &body](const Tag& tag, bool reopened) {
+    output->append("<");
+    output->append(tag.Element());
+    output->append(" ");
+    tag.AppendAttributes(output, body, reopened);
+    output->append(">");
+  };
+  auto CloseTag = [output](const Tag& tag) {
+    output->append("</");
+    output->append(tag.Element());
+    output->append(">");
   };
 
-  int pos = 0, start = 0;
-  for (const auto& it : tagsets) {
-    auto nextstop = std::min<ssize_t>(size, it.first);
-    const auto& tagset = it.second;
-
-    for (; pos < nextstop; ++pos) {
-      if (data[pos] == '&' || data[pos] == '<' || data[pos] == '>') {
-        retval.append(data + start, pos - start);
-        start = pos + 1;
-
-        switch (data[pos]) {
-          case '&':
-            retval.append("&amp;");
-            break;
-          case '<':
-            retval.append("&lt;");
-            break;
-          case '>':
-            retval.append("&gt;");
-            break;
-        }
-      }
+  // Ranks of the tags currently open, only tracked to break pages.
+  std::vector<uint32_t> open;
+  const bool paged = lines && lines->page_lines > 0;
+  uint64_t line = 0;
+  auto StartLine = [&]() {
+    const bool page = paged && ++line % lines->page_lines == 0;
+    if (page) {
+      for (auto it = open.rbegin(); it != open.rend(); ++it)
+        CloseTag(tags_[sorted[*it]]);
+    }
+    lines->offsets.push_back(output->size());
+    if (page) {
+      for (const auto rank : open) OpenTag(tags_[sorted[rank]], true);
+    }
+  };
+  auto AppendText = [&](size_t start, size_t end) {
+    while (lines && start < end) {
+      const auto* newline =
+          static_cast<const char*>(memchr(data + start, '\n', end - start));
+      if (!newline) break;
+      const size_t next = newline - data + 1;
+      AppendEscapedHtml(output, data + start, next - start);
+      start = next;
+      StartLine();
     }
+    AppendEscapedHtml(output, data + start, end - start);
+  };
 
-    retval.append(data + start, pos - start);
-    start = pos;
+  if (lines) lines->offsets.push_back(output->size());
 
-    for (const auto& ait : tagset->closes) {
-      const auto& tag = ait.second;
-      if (tag == nullptr) continue;
-      CloseTag(*tag);
+  for (const auto event : events) {
+    const size_t offset = std::min<size_t>(event >> 32, size);
+    if (offset > pos) {
+      AppendText(pos, offset);
+      pos = offset;
     }
 
-    int order = 0;
-    for (auto& ait : tagset->opens) {
-      std::string to_print;
+    if (!(event & kEventOpen)) {
+      const uint32_t rank = ~event & kEventRankMask;
+      CloseTag(tags_[sorted[rank]]);
+      // Tags are mostly closed in the reverse order they were opened.
+      if (paged)
+        open.erase(std::find(open.rbegin(), open.rend(), rank).base() - 1);
+      continue;
+    }
 
-      auto& tag = ait.second;
-      if (tag == nullptr) continue;
+    const uint32_t rank = event & kEventRankMask;
+    const auto& tag = tags_[sorted[rank]];
+    OpenTag(tag, false);
+    if (tag.close >= 0 && tag.close <= tag.open) {
+      CloseTag(tag);
+    } else if (paged) {
+      open.push_back(rank);
+    }
+  }
+  AppendText(pos, size);
+  if (lines) lines->offsets.push_back(output->size());
 
-      ++order;
-      to_print.append("<");
-      to_print.append(tag->tag);
-      if (!tag->attributes.empty()) {
-        to_print.append(" ");
-        to_print.append(tag->attributes.data(), tag->attributes.size());
-      }
-      to_print.append(">");
-
-      if (tag->close >= 0) {
-        if (pos >= tag->close) {
-          CloseTag(*tag);
-        } else {
-          AddClose(&tagsets, tag, order);
-        }
-      }
+  // Ensure deletion / cleaning the vector.
+  std::vector<Tag>().swap(tags_);
+}
+
+template void HtmlRewriter::Generate(const StringRef& filename,
+                                     const StringRef& body,
+                                     std::string* output, HtmlLines* lines);
+template void HtmlRewriter::Generate(const StringRef& filename,
+                                     const StringRef& body, FileWriter* output,
+                                     HtmlLines* lines);
 
-      retval.append(to_print);
+static_assert(static_cast<int>(Tag::kSpan) == kAnnotationSpan &&
+                  static_cast<int>(Tag::kKeyword) == kAnnotationKeyword &&
+                  static_cast<int>(Tag::kUse) == kAnnotationUse &&
+                  static_cast<int>(Tag::kDefine) == kAnnotationDefine &&
+                  static_cast<int>(Tag::kDeclare) == kAnnotationDeclare &&
+                  static_cast<int>(Tag::kInclude) == kAnnotationInclude,
+              "Tag kinds must match the annotation kinds in cindex.h");
+
+template <typename OutputT>
+static void AppendRaw(OutputT* output, const void* data, size_t size) {
+  output->append(static_cast<const char*>(data), size);
+}
+
+template <typename OutputT>
+void HtmlRewriter::Annotate(const StringRef& body, OutputT* output) {
+  const auto& sorted = SortTags();
+
+  std::map<const char*, uint16_t, ConstCharCmp> classes;
+  std::vector<const char*> classes_list;
+  std::map<std::pair<uint64_t, ObjectId>, uint32_t> targets;
+  std::vector<AnnotationTarget> targets_list;
+
+  std::vector<Annotation> annotations;
+  annotations.reserve(sorted.size());
+  for (const auto index : sorted) {
+    const auto& tag = tags_[index];
+
+    Annotation annotation;
+    annotation.offset = tag.open;
+    // Tags never closed in the html are closed at the end of the body.
+    annotation.length =
+        tag.close < 0 ? std::max<int64_t>(body.size() - tag.open, 0)
+                      : std::max(tag.close - tag.open, 0);
+    annotation.kind = tag.kind;
+    annotation.flags = 0;
+
+    auto cinserted = classes.emplace(tag.classes, classes_list.size());
+    if (cinserted.second) classes_list.push_back(tag.classes);
+    annotation.classes = cinserted.first->second;
+
+    annotation.target = 0;
+    if (tag.kind != Tag::kSpan && tag.kind != Tag::kKeyword) {
+      auto tinserted = targets.emplace(std::make_pair(tag.file, tag.object),
+                                       targets_list.size());
+      if (tinserted.second)
+        targets_list.push_back({tag.file, {tag.object.sl, tag.object.el}});
+      annotation.target = tinserted.first->second;
     }
+    annotations.push_back(annotation);
+  }
+
+  AnnotationHeader header;
+  header.annotations = annotations.size();
+  header.targets = targets_list.size();
+  header.classes = classes_list.size();
+  header.sourcesize = body.size();
+
+  AppendRaw(output, &header, sizeof(header));
+  AppendRaw(output, annotations.data(),
+            annotations.size() * sizeof(annotations[0]));
+  AppendRaw(output, targets_list.data(),
+            targets_list.size() * sizeof(targets_list[0]));
+  for (const auto* name : classes_list) {
+    const uint16_t size = strlen(name);
+    AppendRaw(output, &size, sizeof(size));
+    AppendRaw(output, name, size);
   }
 
-  // Ensure deletion / cleaning the vector.
   std::vector<Tag>().swap(tags_);
-  retval.shrink_to_fit();
-  return retval;
 }
+
+template void HtmlRewriter::Annotate(const StringRef& body,
+                                     std::string* output);
+template void HtmlRewriter::Annotate(const StringRef& body, FileWriter* output);
@@ -30,85 +30,149 @@
 #define REWRITER_H
 
 #include "common.h"
-#include "mempool.h"
 
 #include <map>
 #include <set>
 #include <string>
 
-extern const char _kTagString[];
-using TagString = UniqString<uint32_t, _kTagString>;
-static_assert(sizeof(TagString) == sizeof(uint32_t),
-              "String is using more space than expected");
-
+// A tag to wrap a range of the source with.
+//
+// Tags only store what is needed to compute their attributes, the html
+// is produced by HtmlRewriter::Generate. Most tags link or anchor to an
+// object, and their attributes are unique: building and storing them for
+// every tag would take more memory than the source itself.
 struct Tag {
-  Tag(Tag&& other) = default;
-  Tag(const Tag& other) = default;
-
-  Tag(const char* tag, const std::string& attrs)
-      : tag(tag), attributes(attrs) {}
+  enum Kind : uint8_t {
+    // <span class='classes'>
+    kSpan,
+    // <span class='keyword TEXT'>, where TEXT is the wrapped keyword.
+    kKeyword,
+    // <a class='classes-uses' href='FILE#OBJECT'>
+    kUse,
+    // <span class='def def-classes' id='OBJECT'>
+    kDefine,
+    // <span class='decl decl-classes' id='OBJECT'>
+    kDeclare,
+    // <a class='include' href='FILE'>
+    kInclude,
+  };
+
+  Tag(Kind kind, const char* classes) : kind(kind), classes(classes) {}
+
+  bool operator==(const Tag& other) const {
+    return kind == other.kind && open == other.open && close == other.close &&
+           (classes == other.classes || !strcmp(classes, other.classes)) &&
+           file == other.file && object == other.object;
+  }
 
-  void Drop() { attributes.Drop(); }
-  bool operator==(const Tag& other) {
-    return (tag == other.tag || !strcmp(tag, other.tag)) &&
-           open == other.open && close == other.close &&
-           attributes == other.attributes;
+  // Returns the name of the html element.
+  const char* Element() const {
+    return kind == kUse || kind == kInclude ? "a" : "span";
   }
 
-  const char* tag = nullptr;
+  // Appends the attributes of the tag to output. body is the text the
+  // offsets of the tag refer to. OutputT is std::string or FileWriter.
+  // reopened is set when the tag is opened again after a page break: the
+  // id was already emitted, and must stay unique in the page.
+  template <typename OutputT>
+  void AppendAttributes(OutputT* output, const StringRef& body,
+                        bool reopened = false) const;
+
+  Kind kind;
   int open = -1;
   int close = -1;
 
-  TagString attributes;
+  // Must outlive the tag, generally a string literal or a clang kind name.
+  const char* classes;
+
+  // Hash of the file linked to, and object within the file.
+  uint64_t file = 0;
+  ObjectId object{0, 0};
 };
 
 static inline std::ostream& operator<<(std::ostream& stream, const Tag& tag) {
-  stream << "<" << (tag.tag ? tag.tag : "-null-") << " " << tag.attributes
-         << "> opened at " << tag.open << ", closed at " << tag.close;
+  std::string attributes;
+  tag.AppendAttributes(&attributes, StringRef());
+  stream << "<" << tag.Element() << " " << attributes << "> opened at "
+         << tag.open << ", closed at " << tag.close;
   return stream;
 }
 
-inline Tag MakeTag(const char* tag, std::initializer_list<StringRef> classes,
-                   std::initializer_list<StringRef> attributes) {
-  std::string elements;
-  if (classes.size()) {
-    elements.append("class='");
-    int i = 0;
-    for (const auto& aclass : classes) {
-      if (i++) elements.append(" ");
-      elements.append(aclass.data(), aclass.size());
-    }
-
-    if (attributes.size())
-      elements.append("' ");
-    else
-      elements.append("'");
-  }
+inline Tag MakeSpanTag(const char* classes) {
+  return Tag(Tag::kSpan, classes);
+}
 
-  int i = 0;
-  for (const auto& attr : attributes) {
-    if (i % 2) {
-      elements.append("='");
-      elements.append(attr);
-      elements.append("'");
-    } else {
-      if (i) elements.append(" ");
-      elements.append(attr);
-    }
-    ++i;
-  }
+inline Tag MakeKeywordTag() { return Tag(Tag::kKeyword, "keyword"); }
+
+inline Tag MakeUseTag(const char* description, uint64_t file,
+                      const ObjectId& object) {
+  Tag tag(Tag::kUse, description);
+  tag.file = file;
+  tag.object = object;
+  return tag;
+}
+
+inline Tag MakeDefineTag(const char* kind, const ObjectId& object) {
+  Tag tag(Tag::kDefine, kind);
+  tag.object = object;
+  return tag;
+}
+
+inline Tag MakeDeclareTag(const char* kind, const ObjectId& object) {
+  Tag tag(Tag::kDeclare, kind);
+  tag.object = object;
+  return tag;
+}
 
-  auto rtag = Tag(tag, elements);
-  return std::move(rtag);
+inline Tag MakeIncludeTag(uint64_t file) {
+  Tag tag(Tag::kInclude, "include");
+  tag.file = file;
+  return tag;
 }
 
+// Offsets of the lines of the source in the html produced by Generate.
+struct HtmlLines {
+  // If not 0, every page_lines lines all the open tags are closed before
+  // the beginning of the line, and reopened after, so the html between
+  // the first line of two pages is complete on its own.
+  int page_lines = 0;
+
+  // Offset in the output of the beginning of each line, followed by the
+  // offset of the end of the html.
+  std::vector<uint64_t> offsets;
+};
+
 class HtmlRewriter {
  public:
+  // Adds a tag, unless an identical one was already added.
   void Add(Tag tag);
+
+  // Returns body with the tags applied, and the text escaped as html.
   std::string Generate(const StringRef& filename, const StringRef& body);
+  // Same, but appends the html to output as it is produced, so it never
+  // needs to be held in memory all at once. OutputT is std::string or
+  // FileWriter. If lines is not null, the offsets of the lines are
+  // appended to it.
+  template <typename OutputT>
+  void Generate(const StringRef& filename, const StringRef& body,
+                OutputT* output, HtmlLines* lines = nullptr);
+
+  // Instead of generating the html, appends the tags to output as an
+  // annotation stream (.jann format, see cindex.h), to be applied to body
+  // when the page is served.
+  template <typename OutputT>
+  void Annotate(const StringRef& body, OutputT* output);
 
  private:
+  void GrowIndex();
+  // Returns the position of the tags with a valid range, in the order they
+  // have to be opened.
+  std::vector<uint32_t> SortTags();
+
   std::vector<Tag> tags_;
+  // Open addressing hash set of the tags added so far, to drop duplicates.
+  // Each slot holds 1 + the position of the tag in tags_, 0 if empty.
+  std::vector<uint32_t> index_;
 };
 
 #endif /* REWRITER_H */
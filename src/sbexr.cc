@@ -30,6 +30,7 @@
 #include "base.h"
 #include "counters.h"
 #include "indexer.h"
+#include "manifest.h"
 #include "pp-tracker.h"
 #include "printer.h"
 #include "wrapping.h"
@@ -120,6 +121,14 @@ cl::opt<std::string> gl_index_dir(
     cl::desc("Directory where to output all generated indexes. Tag "
              "name is used to name files."),
     cl::value_desc("directory"), cl::cat(gl_category), cl::Required);
+cl::opt<bool> gl_atomic_output(
+    "atomic-output", cl::init(false),
+    cl::desc("Generate files in a new directory, synced to disk once at the "
+             "end and then swapped with output/sources, so the old output "
+             "is served until the new one is complete. The index files of "
+             "the tag are also staged, and moved in place right after, the "
+             ".symbols.json last."),
+    cl::cat(gl_category));
 cl::opt<std::string> gl_jsondb_dir(
     "jsondb",
     cl::desc("Directory where the compile_commands.json file can be found."),
@@ -231,6 +240,17 @@ int main(int argc, const char** argv) {
   LLVMInitializeX86TargetMC();
   LLVMInitializeX86AsmParser();
 
+  if (gl_incremental_output && gl_atomic_output) {
+    std::cerr << "ERROR: --incremental-output compares with the files in "
+                 "place, it cannot be used with --atomic-output\n";
+    return 1;
+  }
+
+  if (gl_precompress_level < 1 || gl_precompress_level > 22) {
+    std::cerr << "ERROR: --precompress-level must be between 1 and 22\n";
+    return 1;
+  }
+
   if (!gl_capture_counter.empty())
     GlobalRegister().Capture(gl_capture_counter, &std::cerr);
 
@@ -252,6 +272,21 @@ int main(int argc, const char** argv) {
             << " (" << GetRealPath(".") << "/output"
             << ")" << std::endl;
 
+  const std::string output_dir = GetOutputDir();
+  if (gl_atomic_output) {
+    SetOutputDir(output_dir + ".new");
+    // Left over by an interrupted run.
+    RemoveTree(GetOutputDir());
+  }
+  // With --atomic-output, the index files are staged next to the ones in use.
+  const std::string index_dir =
+      gl_atomic_output
+          ? JoinPath({gl_index_dir, "." + gl_tag.getValue() + ".new"})
+          : gl_index_dir.getValue();
+  if (gl_atomic_output) RemoveTree(index_dir);
+  if (gl_incremental_output) GlobalOutputManifest().Load();
+  if (!CheckObjectsDir()) return 1;
+
   std::string error;
   // A Rewriter helps us manage the code rewriting task.
   std::list<ToParse> to_parse;
@@ -287,6 +322,7 @@ int main(int argc, const char** argv) {
   FileCache cache(&renderer);
 
   Indexer indexer(&cache);
+  indexer.MapPoolsToFiles(index_dir.c_str(), gl_tag.c_str());
   SbexrRecorder recorder(&cache, &indexer);
   SbexrAstConsumer consumer(&recorder);
 
@@ -299,7 +335,7 @@ int main(int argc, const char** argv) {
     const auto parsing = std::move(to_parse.front());
     to_parse.pop_front();
 
-    const auto& filename = cache.GetFileFor(parsing.file)->path;
+    const auto& filename = cache.GetFileFor(parsing.file)->path.str();
 
     std::cerr << to_parse.size() << " PARSING " << filename << " ("
               << parsing.file << " in " << parsing.directory << ") "
@@ -314,7 +350,7 @@ int main(int argc, const char** argv) {
                 << " FAILED - SKIPPING ARGV" << std::endl;
       continue;
     }
-    renderer.SetWorkingPath(parsing.directory);
+    cache.StartParsing(parsing.directory);
 
     {
       auto nci = CreateCompilerInstance(parsing.argv);
@@ -343,7 +379,7 @@ int main(int argc, const char** argv) {
         auto fid = sm.translateFile(it->getFirst());
         if (!fid.isValid()) std::cerr << "UNEXPECTED INVALID FID";
         if (gl_verbose)
-          std::cerr << "RENDERING FILE " << cache.GetFileFor(sm, fid)->name
+          std::cerr << "RENDERING FILE " << cache.GetFileFor(sm, fid)->name.str()
                     << std::endl;
         renderer.RenderFile(sm, cache.GetFileFor(sm, fid), fid, pp);
       }
@@ -351,7 +387,7 @@ int main(int argc, const char** argv) {
   }
 
   std::cerr << ">>> GENERATING INDEX" << std::endl;
-  indexer.OutputBinaryIndex(gl_index_dir.c_str(), gl_tag.c_str());
+  indexer.OutputBinaryIndex(index_dir.c_str(), gl_tag.c_str());
   indexer.Clear();
 
   MemoryPrinter::OutputStats();
@@ -362,7 +398,9 @@ int main(int argc, const char** argv) {
   }
   renderer.OutputJFiles();
   renderer.OutputJOther();
-  renderer.OutputJsonTree(gl_index_dir.c_str(), gl_tag.c_str());
+  renderer.OutputJsonTree(index_dir.c_str(), gl_tag.c_str());
+  if (gl_incremental_output && !GlobalOutputManifest().Save())
+    std::cerr << "ERROR: FAILED TO SAVE OUTPUT MANIFEST" << std::endl;
   MemoryPrinter::OutputStats();
 
   std::cerr << "COUNTERS" << std::endl;
@@ -395,5 +433,10 @@ int main(int argc, const char** argv) {
     }
   }
 
+  if (gl_atomic_output &&
+      (!CommitOutputDir(output_dir) ||
+       !CommitStagedFiles(index_dir, gl_index_dir, ".symbols.json")))
+    return 1;
+
   return 0;
 }
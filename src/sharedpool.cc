@@ -0,0 +1,174 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#include "sharedpool.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+size_t SharedPool::StringRecordSize(const char* data, size_t available) {
+  uint32_t size;
+  if (available < sizeof(size)) return 0;
+  memcpy(&size, data, sizeof(size));
+  if (available - sizeof(size) < size) return 0;
+  return sizeof(size) + size;
+}
+
+bool SharedPool::Open() {
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd_ < 0) {
+    std::cerr << "ERROR: could not open shared pool " << path_ << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  if (flock(fd_, LOCK_EX) != 0) {
+    std::cerr << "ERROR: could not lock shared pool " << path_ << ": "
+              << strerror(errno) << std::endl;
+    Close();
+    return false;
+  }
+
+  struct stat stats;
+  if (fstat(fd_, &stats) != 0) {
+    std::cerr << "ERROR: could not stat shared pool " << path_ << std::endl;
+    Close();
+    return false;
+  }
+  if (stats.st_size <= 0) return true;
+
+  void* mapped =
+      mmap(nullptr, stats.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "ERROR: could not mmap shared pool " << path_ << std::endl;
+    Close();
+    return false;
+  }
+  mapped_ = static_cast<const char*>(mapped);
+  mapped_size_ = stats.st_size;
+
+  size_t offset = 0;
+  while (offset < mapped_size_) {
+    auto size = sizer_(mapped_ + offset, mapped_size_ - offset);
+    if (!size) break;
+
+    records_.insert(
+        std::make_pair(hash_value(StringRef(mapped_ + offset, size)),
+                       static_cast<uint32_t>(offset)));
+    offset += size;
+  }
+
+  // Only way to get here is if a previous run died while appending.
+  if (offset < mapped_size_) {
+    std::cerr << "WARNING: dropping truncated record at the end of shared pool "
+              << path_ << std::endl;
+    mapped_size_ = offset;
+    if (ftruncate(fd_, offset) != 0) {
+      std::cerr << "ERROR: could not truncate shared pool " << path_
+                << std::endl;
+      Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+const char* SharedPool::GetRecord(uint32_t offset) const {
+  if (offset < mapped_size_) return mapped_ + offset;
+  return appended_.data() + (offset - mapped_size_);
+}
+
+bool SharedPool::Add(const char* record, size_t size, uint32_t* offset) {
+  const auto hash = hash_value(StringRef(record, size));
+  auto found = records_.find(hash);
+  if (found != records_.end()) {
+    const auto* existing = GetRecord(found->second);
+    // Collisions on a 64 bit hash should be rare enough to not be worth
+    // indexing: just append another copy of the record.
+    if (sizer_(existing, size) == size && !memcmp(existing, record, size)) {
+      *offset = found->second;
+      return true;
+    }
+  }
+
+  const uint64_t end = mapped_size_ + appended_.size();
+  if (end + size > std::numeric_limits<uint32_t>::max()) {
+    std::cerr << "ERROR: shared pool " << path_
+              << " would grow past 4Gb, record not added!" << std::endl;
+    return false;
+  }
+
+  *offset = static_cast<uint32_t>(end);
+  appended_.append(record, size);
+  if (found == records_.end()) records_.insert(std::make_pair(hash, *offset));
+  return true;
+}
+
+bool SharedPool::Close() {
+  if (fd_ < 0) return true;
+
+  bool result = true;
+  size_t written = 0;
+  while (written < appended_.size()) {
+    auto size = pwrite(fd_, appended_.data() + written,
+                       appended_.size() - written, mapped_size_ + written);
+    if (size < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "ERROR: could not append to shared pool " << path_ << ": "
+                << strerror(errno) << std::endl;
+      result = false;
+      break;
+    }
+    written += size;
+  }
+
+  if (mapped_) munmap(const_cast<char*>(mapped_), mapped_size_);
+  mapped_ = nullptr;
+  mapped_size_ = 0;
+  std::string().swap(appended_);
+  google::sparse_hash_map<uint64_t, uint32_t>().swap(records_);
+
+  // Closing the file descriptor also releases the lock.
+  close(fd_);
+  fd_ = -1;
+  return result;
+}
+
+bool SharedPool::Link(const std::string& link) const {
+  const auto& target = GetRealPath(path_);
+  if (unlink(link.c_str()) != 0 && errno != ENOENT) {
+    std::cerr << "ERROR: could not remove " << link << std::endl;
+    return false;
+  }
+  if (symlink(target.c_str(), link.c_str()) != 0) {
+    std::cerr << "ERROR: could not link " << link << " to " << target
+              << std::endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#ifndef SHAREDPOOL_H
+#define SHAREDPOOL_H
+
+#include "base.h"
+#include "common.h"
+
+#include <sparsehash/sparse_hash_map>
+#include <functional>
+#include <string>
+
+// A pool of records shared by the indexes of multiple tags.
+//
+// Indexes of different versions of the same project tend to have mostly the
+// same snippets, strings and file names. A SharedPool is an append only file
+// of records addressed by content: a record is only appended if an identical
+// one is not already in the file, so the pool grows with the delta between
+// versions, rather than with the number of versions.
+//
+// Offsets of records never change once written, so indexes already built
+// (and possibly mmap'd by the server) stay valid as the pool grows.
+//
+// The file is locked with flock() between Open() and Close(), so multiple
+// indexers can safely share the same pool.
+class SharedPool {
+ public:
+  // Given a pointer to a record and the number of bytes available, returns
+  // the size of the record, or 0 if the record is truncated.
+  using RecordSizer = std::function<size_t(const char* data, size_t available)>;
+
+  SharedPool(const std::string& path, RecordSizer sizer)
+      : path_(path), sizer_(std::move(sizer)) {}
+  ~SharedPool() { Close(); }
+
+  SharedPool(const SharedPool& other) = delete;
+  SharedPool& operator=(const SharedPool& other) = delete;
+
+  // Opens the pool, creating it if necessary, and indexes existing records.
+  bool Open();
+  // Appends all new records to the file, and releases the lock.
+  bool Close();
+
+  // Returns the offset of a record identical to the one supplied, appending
+  // it to the pool if necessary. Returns false if the pool would grow past
+  // what an uint32_t offset can address.
+  bool Add(const char* record, size_t size, uint32_t* offset);
+
+  // Makes link point to the pool file.
+  bool Link(const std::string& link) const;
+
+  const std::string& GetPath() const { return path_; }
+
+  // RecordSizer for pools of <uint32_t length><string> records, like the
+  // ones of the ConstString family.
+  static size_t StringRecordSize(const char* data, size_t available);
+
+ private:
+  const char* GetRecord(uint32_t offset) const;
+
+  const std::string path_;
+  RecordSizer sizer_;
+
+  int fd_ = -1;
+
+  // Content of the file at the time it was opened.
+  const char* mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  // Records added since the file was opened.
+  std::string appended_;
+
+  // Maps the hash of a record to its offset.
+  google::sparse_hash_map<uint64_t, uint32_t> records_;
+};
+
+#endif /* SHAREDPOOL_H */
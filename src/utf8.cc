@@ -0,0 +1,363 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SBEXR_X86_UTF8
+#endif
+
+// Adapted from:
+// Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
+// See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
+static constexpr const uint32_t kUtf8Accept = 0;
+static constexpr const uint32_t kUtf8Reject = 1;
+
+static constexpr const uint8_t kUtf8Dfa[] = {
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 00..1f
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 20..3f
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 40..5f
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  // 60..7f
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   9,   9,   9,   9,   9,   9,
+    9,   9,   9,   9,   9,   9,   9,   9,   9,   9,  // 80..9f
+    7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+    7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+    7,   7,   7,   7,   7,   7,   7,   7,   7,   7,  // a0..bf
+    8,   8,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+    2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+    2,   2,   2,   2,   2,   2,   2,   2,   2,   2,  // c0..df
+    0xa, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3,
+    0x3, 0x3, 0x4, 0x3, 0x3,  // e0..ef
+    0xb, 0x6, 0x6, 0x6, 0x5, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8,
+    0x8, 0x8, 0x8, 0x8, 0x8,  // f0..ff
+    0x0, 0x1, 0x2, 0x3, 0x5, 0x8, 0x7, 0x1, 0x1, 0x1, 0x4,
+    0x6, 0x1, 0x1, 0x1, 0x1,  // s0..s0
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   0,   1,   1,   1,   1,
+    1,   0,   1,   0,   1,   1,   1,   1,   1,   1,  // s1..s2
+    1,   2,   1,   1,   1,   1,   1,   2,   1,   2,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   2,   1,   1,   1,   1,   1,   1,   1,   1,  // s3..s4
+    1,   2,   1,   1,   1,   1,   1,   1,   1,   2,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   3,   1,   3,   1,   1,   1,   1,   1,   1,  // s5..s6
+    1,   3,   1,   1,   1,   1,   1,   3,   1,   3,   1,
+    1,   1,   1,   1,   1,   1,   3,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  // s7..s8
+};
+
+static inline bool IsControl(uint8_t c) {
+  return (c < 0x20 && (c < '\t' || c > '\r')) || c == 0x7f;
+}
+
+static TextType ClassifyTextScalar(const uint8_t* data, const uint8_t* end) {
+  bool ascii = true;
+  uint32_t state = kUtf8Accept;
+  while (data < end) {
+    // Skip 8 bytes at a time while they are all printable ascii, that is
+    // no byte is < 0x20 or > 0x7e.
+    constexpr uint64_t kOnes = 0x0101010101010101ULL;
+    constexpr uint64_t kHighs = 0x8080808080808080ULL;
+    while (state == kUtf8Accept && end - data >= 8) {
+      uint64_t word;
+      memcpy(&word, data, sizeof(word));
+      if (((word - kOnes * 0x20) & ~word & kHighs) ||
+          (((word + kOnes * (0x7f - 0x7e)) | word) & kHighs))
+        break;
+      data += 8;
+    }
+    if (data >= end) break;
+
+    const uint8_t c = *data++;
+    if (c < 0x80) {
+      // An ascii character in the middle of a multi byte sequence.
+      if (state != kUtf8Accept || IsControl(c)) return kTextBinary;
+      continue;
+    }
+
+    ascii = false;
+    state = kUtf8Dfa[256 + state * 16 + kUtf8Dfa[c]];
+    if (state == kUtf8Reject) return kTextBinary;
+  }
+  if (state != kUtf8Accept) return kTextBinary;
+  return ascii ? kTextAscii : kTextUtf8;
+}
+
+#ifdef SBEXR_X86_UTF8
+// The lookup algorithm from "Validating UTF-8 In Less Than One Instruction
+// Per Byte", by John Keiser and Daniel Lemire, as used in simdjson and
+// simdutf. Each byte is checked together with the one before it, with
+// three table lookups on their nibbles, which must all agree on an error:
+static constexpr const uint8_t kTooShort = 1 << 0;   // 11______ 0_______
+                                                     // 11______ 11______
+static constexpr const uint8_t kTooLong = 1 << 1;    // 0_______ 10______
+static constexpr const uint8_t kOverlong3 = 1 << 2;  // 11100000 100_____
+static constexpr const uint8_t kTooLarge = 1 << 3;   // 11110100 1001____
+                                                     // 11110100 101_____
+                                                     // 111101__ 10______
+                                                     // 11111___ 10______
+static constexpr const uint8_t kSurrogate = 1 << 4;  // 11101101 101_____
+static constexpr const uint8_t kOverlong2 = 1 << 5;  // 1100000_ 10______
+static constexpr const uint8_t kTooLarge1000 = 1 << 6;  // 11110101 1000____
+                                                        // 1111011_ 1000____
+                                                        // 11111___ 1000____
+static constexpr const uint8_t kOverlong4 = 1 << 6;  // 11110000 1000____
+static constexpr const uint8_t kTwoConts = 1 << 7;   // 10______ 10______
+static constexpr const uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+// Indexed by the high nibble of the first byte.
+alignas(16) static constexpr const uint8_t kByte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTooLong, kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2, kTooShort, kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4};
+// Indexed by the low nibble of the first byte.
+alignas(16) static constexpr const uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000};
+// Indexed by the high nibble of the second byte.
+alignas(16) static constexpr const uint8_t kByte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort};
+
+// The ssse3 and avx2 versions are the same code, with 16 or 32 bytes
+// vectors. Blocks are checked against the last bytes of the previous one.
+// The end of the buffer is padded with spaces, so a sequence cut short by
+// the end of the buffer is an error like any other.
+
+// Initialized in the functions with the right target, so no member
+// initializers here.
+struct Ssse3State {
+  __m128i previous;
+  __m128i incomplete;
+  __m128i error;
+  __m128i high;
+};
+
+__attribute__((target("ssse3"), always_inline)) static inline void
+CheckBlockSsse3(const __m128i input, Ssse3State* state) {
+  // Control characters: < 0x20 but not \t to \r, or 0x7f.
+  const __m128i below_space = _mm_cmpeq_epi8(
+      _mm_max_epu8(input, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f));
+  const __m128i tab_to_cr = _mm_sub_epi8(input, _mm_set1_epi8('\t'));
+  const __m128i whitespace = _mm_cmpeq_epi8(
+      _mm_min_epu8(tab_to_cr, _mm_set1_epi8('\r' - '\t')), tab_to_cr);
+  const __m128i del = _mm_cmpeq_epi8(input, _mm_set1_epi8(0x7f));
+  state->error = _mm_or_si128(
+      state->error, _mm_or_si128(_mm_andnot_si128(whitespace, below_space), del));
+
+  if (!_mm_movemask_epi8(input)) {
+    // A multi byte sequence at the end of the previous block was cut short.
+    state->error = _mm_or_si128(state->error, state->incomplete);
+    state->previous = input;
+    return;
+  }
+  state->high = _mm_or_si128(state->high, input);
+
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i prev1 = _mm_alignr_epi8(input, state->previous, 15);
+  const __m128i byte1_high = _mm_shuffle_epi8(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1High)),
+      _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  const __m128i byte1_low = _mm_shuffle_epi8(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1Low)),
+      _mm_and_si128(prev1, nibble));
+  const __m128i byte2_high = _mm_shuffle_epi8(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(kByte2High)),
+      _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+  const __m128i special =
+      _mm_and_si128(_mm_and_si128(byte1_high, byte1_low), byte2_high);
+
+  // Third and fourth bytes of 3 and 4 bytes sequences must be continuations,
+  // which is where special has kTwoConts set.
+  const __m128i prev2 = _mm_alignr_epi8(input, state->previous, 14);
+  const __m128i prev3 = _mm_alignr_epi8(input, state->previous, 13);
+  const __m128i must_continue = _mm_and_si128(
+      _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+                   _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80))),
+      _mm_set1_epi8(0x80));
+  state->error =
+      _mm_or_si128(state->error, _mm_xor_si128(must_continue, special));
+
+  // Leading bytes in the last 3 positions that need more bytes than left.
+  state->incomplete = _mm_subs_epu8(
+      input, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                           0xf0 - 1, 0xe0 - 1, 0xc0 - 1));
+  state->previous = input;
+}
+
+__attribute__((target("ssse3"))) static TextType ClassifyTextSsse3(
+    const uint8_t* data, const uint8_t* end) {
+  const __m128i zero = _mm_setzero_si128();
+  Ssse3State state = {zero, zero, zero, zero};
+  for (; end - data >= 16; data += 16) {
+    CheckBlockSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)),
+                    &state);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(state.error, zero)) != 0xffff)
+      return kTextBinary;
+  }
+
+  uint8_t tail[16];
+  memset(tail, ' ', sizeof(tail));
+  memcpy(tail, data, end - data);
+  CheckBlockSsse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tail)),
+                  &state);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(state.error, zero)) != 0xffff)
+    return kTextBinary;
+  return _mm_movemask_epi8(state.high) ? kTextUtf8 : kTextAscii;
+}
+
+struct Avx2State {
+  __m256i previous;
+  __m256i incomplete;
+  __m256i error;
+  __m256i high;
+};
+
+__attribute__((target("avx2"), always_inline)) static inline void
+CheckBlockAvx2(const __m256i input, Avx2State* state) {
+  const __m256i below_space = _mm256_cmpeq_epi8(
+      _mm256_max_epu8(input, _mm256_set1_epi8(0x1f)), _mm256_set1_epi8(0x1f));
+  const __m256i tab_to_cr = _mm256_sub_epi8(input, _mm256_set1_epi8('\t'));
+  const __m256i whitespace = _mm256_cmpeq_epi8(
+      _mm256_min_epu8(tab_to_cr, _mm256_set1_epi8('\r' - '\t')), tab_to_cr);
+  const __m256i del = _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7f));
+  state->error = _mm256_or_si256(
+      state->error,
+      _mm256_or_si256(_mm256_andnot_si256(whitespace, below_space), del));
+
+  if (!_mm256_movemask_epi8(input)) {
+    state->error = _mm256_or_si256(state->error, state->incomplete);
+    state->previous = input;
+    return;
+  }
+  state->high = _mm256_or_si256(state->high, input);
+
+  // alignr works within 128 bits lanes: shift in the previous block's
+  // high lane in front of the low lane.
+  const __m256i shifted =
+      _mm256_permute2x128_si256(state->previous, input, 0x21);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+  const __m256i byte1_high = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1High))),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+  const __m256i byte1_low = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1Low))),
+      _mm256_and_si256(prev1, nibble));
+  const __m256i byte2_high = _mm256_shuffle_epi8(
+      _mm256_broadcastsi128_si256(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(kByte2High))),
+      _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+  const __m256i special =
+      _mm256_and_si256(_mm256_and_si256(byte1_high, byte1_low), byte2_high);
+
+  const __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+  const __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+  const __m256i must_continue = _mm256_and_si256(
+      _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+                      _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80))),
+      _mm256_set1_epi8(0x80));
+  state->error =
+      _mm256_or_si256(state->error, _mm256_xor_si256(must_continue, special));
+
+  state->incomplete = _mm256_subs_epu8(
+      input, _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                              -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                              -1, -1, -1, -1, -1, 0xf0 - 1, 0xe0 - 1,
+                              0xc0 - 1));
+  state->previous = input;
+}
+
+__attribute__((target("avx2"))) static TextType ClassifyTextAvx2(
+    const uint8_t* data, const uint8_t* end) {
+  const __m256i zero = _mm256_setzero_si256();
+  Avx2State state = {zero, zero, zero, zero};
+  for (; end - data >= 32; data += 32) {
+    CheckBlockAvx2(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data)), &state);
+    if (!_mm256_testz_si256(state.error, state.error)) return kTextBinary;
+  }
+
+  uint8_t tail[32];
+  memset(tail, ' ', sizeof(tail));
+  memcpy(tail, data, end - data);
+  CheckBlockAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail)),
+                 &state);
+  if (!_mm256_testz_si256(state.error, state.error)) return kTextBinary;
+  return _mm256_movemask_epi8(state.high) ? kTextUtf8 : kTextAscii;
+}
+#endif
+
+using ClassifyTextFunction = TextType (*)(const uint8_t*, const uint8_t*);
+
+static ClassifyTextFunction SelectClassifyText() {
+#ifdef SBEXR_X86_UTF8
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return ClassifyTextAvx2;
+  if (__builtin_cpu_supports("ssse3")) return ClassifyTextSsse3;
+#endif
+  return ClassifyTextScalar;
+}
+
+TextType ClassifyText(const char* data, size_t size) {
+  static const ClassifyTextFunction classify = SelectClassifyText();
+  const auto* begin = reinterpret_cast<const uint8_t*>(data);
+  return classify(begin, begin + size);
+}
@@ -0,0 +1,128 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#include "writer.h"
+
+#include "llvm/ADT/StringExtras.h"
+
+#include <sys/uio.h>
+
+bool FileWriter::Open(const std::string& path, int flags, int mode) {
+  Close();
+
+  path_ = path;
+  error_ = false;
+  offset_ = 0;
+  hash_.clear();
+  fd_ = open(path.c_str(), flags, mode);
+  if (fd_ < 0) {
+    std::cerr << "ERROR: could not open " << path << ": " << strerror(errno)
+              << std::endl;
+    error_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool FileWriter::Close() {
+  if (fd_ < 0) return !error_;
+
+  Flush();
+  if (sha1_) {
+    hash_ = llvm::toHex(sha1_->final(), true);
+    sha1_.reset();
+  }
+  if (close(fd_) < 0 && !error_) {
+    std::cerr << "ERROR: could not close " << path_ << ": " << strerror(errno)
+              << std::endl;
+    error_ = true;
+  }
+  fd_ = -1;
+  return !error_;
+}
+
+void FileWriter::Flush() {
+  Write(buffer_.get(), used_);
+  used_ = 0;
+}
+
+void FileWriter::AppendSlow(const char* data, size_t size) {
+  if (size < size_) {
+    Flush();
+    memcpy(buffer_.get(), data, size);
+    used_ = size;
+    return;
+  }
+
+  if (sha1_) {
+    sha1_->update(StringRef(buffer_.get(), used_));
+    sha1_->update(StringRef(data, size));
+  }
+
+  struct iovec iov[2] = {{buffer_.get(), used_},
+                         {const_cast<char*>(data), size}};
+  struct iovec* next = used_ ? iov : iov + 1;
+  int count = used_ ? 2 : 1;
+  used_ = 0;
+
+  while (count > 0 && !error_ && fd_ >= 0) {
+    auto written = writev(fd_, next, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "ERROR: could not write " << path_ << ": "
+                << strerror(errno) << std::endl;
+      error_ = true;
+      return;
+    }
+
+    for (; count > 0 && static_cast<size_t>(written) >= next->iov_len;
+         ++next, --count)
+      written -= next->iov_len;
+    if (count > 0) {
+      next->iov_base = static_cast<char*>(next->iov_base) + written;
+      next->iov_len -= written;
+    }
+  }
+}
+
+bool FileWriter::Write(const char* data, size_t size) {
+  if (sha1_) sha1_->update(StringRef(data, size));
+  while (size > 0 && !error_ && fd_ >= 0) {
+    auto written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "ERROR: could not write " << path_ << ": "
+                << strerror(errno) << std::endl;
+      error_ = true;
+      break;
+    }
+    data += written;
+    size -= written;
+  }
+  return !error_;
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2017 Carlo Contavalli (ccontavalli@gmail.com).
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+//    2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY Carlo Contavalli ''AS IS'' AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL Carlo Contavalli OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+// THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// The views and conclusions contained in the software and documentation are
+// those of the authors and should not be interpreted as representing official
+// policies, either expressed or implied, of Carlo Contavalli.
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "base.h"
+
+#include "llvm/Support/SHA1.h"
+
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+
+// Buffered writer to a file descriptor.
+//
+// Small writes are accumulated in a fixed buffer. Writes larger than the
+// buffer are passed to the kernel with a single writev together with what
+// is buffered, without being copied.
+//
+// Implements append() like a std::string, so it can be used as a sink for
+// HtmlRewriter::Generate and AppendEscapedHtml, and Put() / Flush() like a
+// rapidjson stream, so it can be used with json::Writer.
+class FileWriter {
+ public:
+  using Ch = char;
+
+  explicit FileWriter(size_t buffer_size = 64 * 1024)
+      : buffer_(new char[buffer_size]), size_(buffer_size) {}
+  ~FileWriter() { Close(); }
+
+  FileWriter(const FileWriter&) = delete;
+  FileWriter& operator=(const FileWriter&) = delete;
+
+  bool Open(const std::string& path,
+            int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            int mode = 0644);
+  // Flushes and closes the file. Returns false if any write failed.
+  bool Close();
+
+  void append(const char* data, size_t size) {
+    offset_ += size;
+    if (size <= size_ - used_) {
+      memcpy(buffer_.get() + used_, data, size);
+      used_ += size;
+      return;
+    }
+    AppendSlow(data, size);
+  }
+  void append(const char* str) { append(str, strlen(str)); }
+  void append(const std::string& str) { append(str.data(), str.size()); }
+
+  void Put(char c) {
+    ++offset_;
+    if (used_ >= size_) Flush();
+    buffer_[used_++] = c;
+  }
+  void Flush();
+
+  bool ok() const { return !error_; }
+
+  // Computes the SHA1 of the next file written, to be called before Open().
+  void HashContent() { sha1_.reset(new llvm::SHA1()); }
+  // Returns the SHA1 in hex, only valid after Close().
+  const std::string& ContentHash() const { return hash_; }
+  // Bytes appended since the file was opened, like std::string::size().
+  uint64_t size() const { return offset_; }
+
+ private:
+  void AppendSlow(const char* data, size_t size);
+  bool Write(const char* data, size_t size);
+
+  std::string path_;
+  int fd_ = -1;
+  bool error_ = false;
+
+  std::unique_ptr<char[]> buffer_;
+  const size_t size_;
+  size_t used_ = 0;
+  uint64_t offset_ = 0;
+
+  std::unique_ptr<llvm::SHA1> sha1_;
+  std::string hash_;
+};
+
+#endif /* WRITER_H */